@@ -0,0 +1,27 @@
+/* Allocation counter shared by the demos whose benchmarks report heap
+    allocations. It replaces the global operator new and delete, so only the
+    single source file of a demo may include it.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+inline std::atomic<std::size_t> g_allocations{0};
+// Kept out of line, GCC otherwise flags the inlined malloc() and free() as
+// mismatched with new and delete.
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    g_allocations++;
+    if(void* p = std::malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept {
+    std::free(p);
+}
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
@@ -4,8 +4,38 @@
     Also used for queuing tasks, tracking operations history etc.
 */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "AllocationCounter.h"
 
 // Interface declaring a method for executing a command
 class Command {
@@ -18,10 +48,13 @@ class SimpleCommand : public Command {
 private:
     std::string pay_load_;
 public:
-    explicit SimpleCommand(std::string pay_load) : pay_load_(pay_load) {}
+    explicit SimpleCommand(std::string pay_load) : pay_load_(std::move(pay_load)) {}
     void Execute() const override {
         std::cout << "SimpleCommand: See, I can do simple things like printing (" << this->pay_load_ << ")\n";
     }
+    const std::string& pay_load() const {
+        return this->pay_load_;
+    }
 };
 // Receiver classes contain some important business logic. They know how to
 // perform all kinds of operations, associated with carrying out a request.
@@ -34,6 +67,23 @@ public:
     void DoSomethingElse(const std::string& b) {
         std::cout << "Receiver: Also working on (" << b << ".)\n";
     }
+    // Bulk variants doing a whole batch of work in one call.
+    void DoSomething(const std::vector<std::string_view>& batch) {
+        std::cout << "Receiver: Working on (";
+        PrintBatch(batch);
+        std::cout << ".)\n";
+    }
+    void DoSomethingElse(const std::vector<std::string_view>& batch) {
+        std::cout << "Receiver: Also working on (";
+        PrintBatch(batch);
+        std::cout << ".)\n";
+    }
+private:
+    static void PrintBatch(const std::vector<std::string_view>& batch) {
+        for(std::size_t i = 0; i < batch.size(); i++) {
+            std::cout << (i ? ", " : "") << batch[i];
+        }
+    }
 };
 // Complex commands can delegate operations to other objects like receivers.
 class ComplexCommand : public Command {
@@ -43,12 +93,31 @@ private:
     std::string b_;
 public:
     ComplexCommand(Receiver* receiver, std::string a, std::string b) :
-        receiver_(receiver), a_(a), b_(b) {}
+        receiver_(receiver), a_(std::move(a)), b_(std::move(b)) {}
     void Execute() const override {
         std::cout << "ComplexCommand: Complex stuff should be done by a receiver object.\n";
         this->receiver_->DoSomething(this->a_);
         this->receiver_->DoSomethingElse(this->b_);
     }
+    Receiver* receiver() const {
+        return this->receiver_;
+    }
+    const std::string& a() const {
+        return this->a_;
+    }
+    const std::string& b() const {
+        return this->b_;
+    }
+};
+// A ComplexCommand with extra behaviour of its own, which must not be
+// coalesced away.
+class AuditedCommand : public ComplexCommand {
+public:
+    using ComplexCommand::ComplexCommand;
+    void Execute() const override {
+        std::cout << "AuditedCommand: Recording who asked for this.\n";
+        ComplexCommand::Execute();
+    }
 };
 // Invoker is associated with one or several commands. It sends a request to command;
 class Invoker {
@@ -80,6 +149,840 @@ public:
         }
     }
 };
+// Records commands and executes them in batches, once max_batch commands are
+// recorded or the oldest one has waited max_delay. Adjacent ComplexCommands for
+// the same receiver are coalesced into one bulk DoSomething and one bulk
+// DoSomethingElse call, so within such a run all the DoSomething work happens
+// before the DoSomethingElse work. The delay is checked on Record and Poll.
+// Like Invoker, the buffer owns the recorded commands.
+class CommandBuffer {
+public:
+    struct Counters {
+        std::size_t commands = 0;
+        std::size_t batches = 0;
+        // Executions are single commands or coalesced runs of commands.
+        std::size_t executions = 0;
+        double AverageBatchSize() const {
+            return this->batches ? double(this->commands) / this->batches : 0.0;
+        }
+        double CoalescingRatio() const {
+            return this->executions ? double(this->commands) / this->executions : 0.0;
+        }
+    };
+private:
+    std::vector<Command*> commands_;
+    std::size_t max_batch_;
+    std::chrono::steady_clock::duration max_delay_;
+    std::chrono::steady_clock::time_point oldest_;
+    Counters counters_;
+    std::vector<Command*> flushing_;
+    std::vector<std::string_view> a_batch_;
+    std::vector<std::string_view> b_batch_;
+    std::ostream* trace_ = nullptr;
+
+    // Only plain ComplexCommands are coalesced. A subclass may override
+    // Execute, so it always runs on its own.
+    static const ComplexCommand* Coalescable(const Command* command) {
+        if(typeid(*command) != typeid(ComplexCommand)) {
+            return nullptr;
+        }
+        return static_cast<const ComplexCommand*>(command);
+    }
+public:
+    CommandBuffer(std::size_t max_batch, std::chrono::steady_clock::duration max_delay) :
+        max_batch_(max_batch), max_delay_(max_delay) {}
+    // Destructors must not throw, so a failing last flush is reported and dropped.
+    ~CommandBuffer() {
+        try {
+            this->Flush();
+        } catch(const std::exception& e) {
+            std::cerr << "CommandBuffer: Last flush failed: " << e.what() << "\n";
+        }
+    }
+    void Record(Command* command) {
+        if(this->commands_.empty()) {
+            this->oldest_ = std::chrono::steady_clock::now();
+        }
+        this->commands_.push_back(command);
+        if(this->commands_.size() >= this->max_batch_) {
+            this->Flush();
+        } else {
+            this->Poll();
+        }
+    }
+    void Poll() {
+        if(!this->commands_.empty() && std::chrono::steady_clock::now() - this->oldest_ >= this->max_delay_) {
+            this->Flush();
+        }
+    }
+    // If a command throws, the rest of the batch is dropped and the exception
+    // propagates.
+    void Flush() {
+        if(this->commands_.empty()) {
+            return;
+        }
+        // The batch is taken out first, so a throwing command can't leave
+        // executed commands behind to run again on the next flush.
+        std::vector<Command*>& batch = this->flushing_;
+        batch.swap(this->commands_);
+        struct Release {
+            std::vector<Command*>& batch;
+            ~Release() {
+                for(Command* command : this->batch) {
+                    delete command;
+                }
+                this->batch.clear();
+            }
+        } release{batch};
+        this->counters_.commands += batch.size();
+        this->counters_.batches++;
+        std::size_t i = 0;
+        while(i < batch.size()) {
+            const ComplexCommand* complex = Coalescable(batch[i]);
+            std::size_t end = i + 1;
+            if(complex) {
+                while(end < batch.size()) {
+                    const ComplexCommand* next = Coalescable(batch[end]);
+                    if(!next || next->receiver() != complex->receiver()) {
+                        break;
+                    }
+                    end++;
+                }
+            }
+            this->counters_.executions++;
+            if(end - i > 1) {
+                this->a_batch_.clear();
+                this->b_batch_.clear();
+                for(std::size_t j = i; j < end; j++) {
+                    const ComplexCommand* command = static_cast<const ComplexCommand*>(batch[j]);
+                    this->a_batch_.push_back(command->a());
+                    this->b_batch_.push_back(command->b());
+                }
+                if(this->trace_) {
+                    *this->trace_ << "CommandBuffer: Coalesced " << end - i << " complex commands for one receiver.\n";
+                }
+                complex->receiver()->DoSomething(this->a_batch_);
+                complex->receiver()->DoSomethingElse(this->b_batch_);
+            } else {
+                batch[i]->Execute();
+            }
+            i = end;
+        }
+    }
+    // Reports every coalesced run to trace, off by default.
+    void set_trace(std::ostream* trace) {
+        this->trace_ = trace;
+    }
+    const Counters& counters() const {
+        return this->counters_;
+    }
+};
+// Append-only binary journal of commands in a memory-mapped file. Records are
+// copied into the mapping and made durable by Commit, which flushes them and
+// then publishes the new committed length in the file header. Commit runs
+// automatically after every group_size appends, so the cost of a sync is
+// shared by the whole group. After a crash, Replay only sees the committed
+// records. Receivers can't be stored, so replay binds every ComplexCommand to
+// the receiver it is given. Close commits the last group and reports a failed
+// sync; the destructor only logs it.
+class CommandJournal {
+private:
+    static constexpr std::uint32_t kMagic = 0x4a444d43;  // "CMDJ"
+    static constexpr std::size_t kHeaderSize = 4096;
+    static constexpr std::size_t kMinCapacity = 1 << 20;
+    enum Type : std::uint8_t { kSimple = 1, kComplex = 2 };
+    struct Header {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t committed;
+    };
+    int fd_ = -1;
+    char* map_ = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t size_;
+    std::size_t committed_;
+    std::size_t group_size_;
+    std::size_t pending_ = 0;
+
+    static void Check(bool ok, const char* what) {
+        if(!ok) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+    }
+    // Grows the file and maps it anew. The old mapping stays valid until the
+    // new one exists, so a failure leaves the journal as it was.
+    void Map(std::size_t capacity) {
+        Check(ftruncate(this->fd_, capacity) == 0, "CommandJournal: resize");
+        void* map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd_, 0);
+        Check(map != MAP_FAILED, "CommandJournal: map");
+        if(this->map_) {
+            munmap(this->map_, this->capacity_);
+        }
+        this->map_ = static_cast<char*>(map);
+        this->capacity_ = capacity;
+    }
+    void Release() {
+        if(this->map_) {
+            munmap(this->map_, this->capacity_);
+            this->map_ = nullptr;
+        }
+        if(this->fd_ >= 0) {
+            close(this->fd_);
+            this->fd_ = -1;
+        }
+    }
+    Header* header() const {
+        return reinterpret_cast<Header*>(this->map_);
+    }
+    void Put(const void* data, std::size_t size) {
+        if(this->size_ + size > this->capacity_) {
+            this->Map(std::max(this->capacity_ * 2, this->size_ + size));
+        }
+        std::memcpy(this->map_ + this->size_, data, size);
+        this->size_ += size;
+    }
+    void PutString(const std::string& value) {
+        std::uint32_t length = value.size();
+        this->Put(&length, sizeof(length));
+        this->Put(value.data(), value.size());
+    }
+    // Returns false when the string would run past end.
+    static bool GetString(const char*& cursor, const char* end, std::string_view& value) {
+        std::uint32_t length;
+        if(static_cast<std::size_t>(end - cursor) < sizeof(length)) {
+            return false;
+        }
+        std::memcpy(&length, cursor, sizeof(length));
+        if(static_cast<std::size_t>(end - cursor) - sizeof(length) < length) {
+            return false;
+        }
+        value = std::string_view(cursor + sizeof(length), length);
+        cursor += sizeof(length) + length;
+        return true;
+    }
+public:
+    CommandJournal(const std::string& path, std::size_t group_size) : group_size_(std::max<std::size_t>(group_size, 1)) {
+        this->fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        Check(this->fd_ >= 0, "CommandJournal: open");
+        try {
+            // The header is checked before the file is grown, so opening a
+            // file which isn't a journal leaves it untouched.
+            off_t length = lseek(this->fd_, 0, SEEK_END);
+            Check(length >= 0, "CommandJournal: size");
+            Header header{kMagic, 1, kHeaderSize};
+            if(length != 0) {
+                if(length < static_cast<off_t>(kHeaderSize) || pread(this->fd_, &header, sizeof(header), 0) != sizeof(header) ||
+                   header.magic != kMagic) {
+                    throw std::runtime_error("CommandJournal: " + path + " is not a command journal");
+                }
+                if(header.committed < kHeaderSize || header.committed > static_cast<std::uint64_t>(length)) {
+                    throw std::runtime_error("CommandJournal: " + path + " has a corrupt header");
+                }
+            }
+            this->Map(std::max<std::size_t>(length, kMinCapacity));
+            *this->header() = header;
+            // Records after the committed length never finished their group.
+            this->size_ = this->committed_ = header.committed;
+        } catch(...) {
+            this->Release();
+            throw;
+        }
+    }
+    ~CommandJournal() {
+        try {
+            this->Close();
+        } catch(const std::exception& e) {
+            std::cerr << "CommandJournal: Last commit failed: " << e.what() << "\n";
+        }
+        this->Release();
+    }
+    // Commits the pending records and closes the file. Throws if the commit
+    // fails, the journal then stays open.
+    void Close() {
+        if(this->fd_ < 0) {
+            return;
+        }
+        this->Commit();
+        this->Release();
+    }
+    void Append(const Command& command) {
+        if(this->fd_ < 0) {
+            throw std::logic_error("CommandJournal: append after Close");
+        }
+        // Subclasses can't be rebuilt by Replay, so only the exact types are journaled.
+        if(typeid(command) == typeid(SimpleCommand)) {
+            std::uint8_t type = kSimple;
+            this->Put(&type, sizeof(type));
+            this->PutString(static_cast<const SimpleCommand&>(command).pay_load());
+        } else if(typeid(command) == typeid(ComplexCommand)) {
+            const ComplexCommand& complex = static_cast<const ComplexCommand&>(command);
+            std::uint8_t type = kComplex;
+            this->Put(&type, sizeof(type));
+            this->PutString(complex.a());
+            this->PutString(complex.b());
+        } else {
+            throw std::invalid_argument("CommandJournal: command type can't be journaled");
+        }
+        if(++this->pending_ >= this->group_size_) {
+            this->Commit();
+        }
+    }
+    void Commit() {
+        if(this->size_ == this->committed_) {
+            return;
+        }
+        std::size_t page = sysconf(_SC_PAGESIZE);
+        std::size_t from = this->committed_ / page * page;
+        Check(msync(this->map_ + from, this->size_ - from, MS_SYNC) == 0, "CommandJournal: sync records");
+        this->header()->committed = this->size_;
+        Check(msync(this->map_, kHeaderSize, MS_SYNC) == 0, "CommandJournal: sync header");
+        this->committed_ = this->size_;
+        this->pending_ = 0;
+    }
+    // Rebuilds every committed command and hands it to visit, by default
+    // executing it. Returns the number of commands replayed. A file which
+    // isn't a journal, or whose committed records don't parse, throws
+    // std::runtime_error before anything past the damage is visited.
+    template<typename Visit>
+    static std::size_t Replay(const std::string& path, Receiver* receiver, Visit&& visit) {
+        int fd = open(path.c_str(), O_RDONLY);
+        Check(fd >= 0, "CommandJournal: open");
+        off_t length = lseek(fd, 0, SEEK_END);
+        if(length < static_cast<off_t>(kHeaderSize)) {
+            close(fd);
+            throw std::runtime_error("CommandJournal: " + path + " is not a command journal");
+        }
+        void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        Check(map != MAP_FAILED, "CommandJournal: map");
+        struct Unmap {
+            void* map;
+            std::size_t length;
+            ~Unmap() {
+                munmap(this->map, this->length);
+            }
+        } unmap{map, static_cast<std::size_t>(length)};
+        const char* data = static_cast<const char*>(map);
+        const Header* header = reinterpret_cast<const Header*>(data);
+        if(header->magic != kMagic) {
+            throw std::runtime_error("CommandJournal: " + path + " is not a command journal");
+        }
+        if(header->committed < kHeaderSize || header->committed > static_cast<std::uint64_t>(length)) {
+            throw std::runtime_error("CommandJournal: " + path + " has a corrupt header");
+        }
+        madvise(map, length, MADV_SEQUENTIAL);
+        std::size_t count = 0;
+        const char* cursor = data + kHeaderSize;
+        const char* end = data + header->committed;
+        std::string_view a, b;
+        while(cursor < end) {
+            std::uint8_t type = *cursor++;
+            if(type == kSimple && GetString(cursor, end, a)) {
+                SimpleCommand command{std::string(a)};
+                visit(command);
+            } else if(type == kComplex && GetString(cursor, end, a) && GetString(cursor, end, b)) {
+                if(!receiver) {
+                    throw std::invalid_argument("CommandJournal: replaying a ComplexCommand needs a receiver");
+                }
+                ComplexCommand command(receiver, std::string(a), std::string(b));
+                visit(command);
+            } else {
+                throw std::runtime_error("CommandJournal: " + path + " has a corrupt record at offset " +
+                                         std::to_string(cursor - 1 - data));
+            }
+            count++;
+        }
+        return count;
+    }
+    static std::size_t Replay(const std::string& path, Receiver* receiver) {
+        return Replay(path, receiver, [](const Command& command) { command.Execute(); });
+    }
+};
+// Per-thread free list of fixed-size blocks for commands which don't fit
+// into an InlineCommand. Blocks freed on another thread join that thread's list.
+class CommandPool {
+public:
+    static constexpr std::size_t kBlockSize = 256;
+    static void* Allocate() {
+        CommandPool& pool = Local();
+        if(Block* block = pool.free_) {
+            pool.free_ = block->next;
+            return block;
+        }
+        return ::operator new(kBlockSize);
+    }
+    static void Release(void* block) {
+        CommandPool& pool = Local();
+        pool.free_ = new (block) Block{pool.free_};
+    }
+private:
+    struct Block {
+        Block* next;
+    };
+    Block* free_ = nullptr;
+    static CommandPool& Local() {
+        thread_local CommandPool pool;
+        return pool;
+    }
+    ~CommandPool() {
+        while(Block* block = this->free_) {
+            this->free_ = block->next;
+            ::operator delete(block);
+        }
+    }
+};
+// Owns one command by value, without a heap allocation per command. Commands
+// up to kInlineSize bytes are built inside the holder, larger ones in a block
+// from the CommandPool, and only commands larger than a pool block go to the
+// heap. Note that string arguments beyond the small-string size still allocate.
+class InlineCommand {
+public:
+    static constexpr std::size_t kInlineSize = 96;
+private:
+    enum class Storage { kEmpty, kInline, kPool, kHeap };
+    alignas(std::max_align_t) unsigned char buffer_[kInlineSize];
+    Command* command_ = nullptr;
+    Storage storage_ = Storage::kEmpty;
+    // Moves an inline command into another buffer, set by Emplace.
+    Command* (*relocate_)(Command* from, void* to) = nullptr;
+
+    template<typename T>
+    static Command* Relocate(Command* from, void* to) {
+        T* command = static_cast<T*>(from);
+        Command* moved = new (to) T(std::move(*command));
+        command->~T();
+        return moved;
+    }
+public:
+    InlineCommand() {}
+    InlineCommand(InlineCommand&& other) noexcept {
+        *this = std::move(other);
+    }
+    InlineCommand& operator=(InlineCommand&& other) noexcept {
+        if(this != &other) {
+            this->Reset();
+            if(other.storage_ == Storage::kInline) {
+                this->command_ = other.relocate_(other.command_, this->buffer_);
+            } else {
+                this->command_ = other.command_;
+            }
+            this->storage_ = other.storage_;
+            this->relocate_ = other.relocate_;
+            other.command_ = nullptr;
+            other.storage_ = Storage::kEmpty;
+        }
+        return *this;
+    }
+    ~InlineCommand() {
+        this->Reset();
+    }
+    template<typename T, typename... Args>
+    void Emplace(Args&&... args) {
+        static_assert(std::is_base_of_v<Command, T>, "InlineCommand only holds commands");
+        this->Reset();
+        if constexpr (sizeof(T) <= kInlineSize && alignof(T) <= alignof(std::max_align_t) &&
+                      std::is_nothrow_move_constructible_v<T>) {
+            this->command_ = new (this->buffer_) T(std::forward<Args>(args)...);
+            this->storage_ = Storage::kInline;
+            this->relocate_ = &InlineCommand::Relocate<T>;
+        } else if constexpr (sizeof(T) <= CommandPool::kBlockSize && alignof(T) <= alignof(std::max_align_t)) {
+            void* block = CommandPool::Allocate();
+            try {
+                this->command_ = new (block) T(std::forward<Args>(args)...);
+            } catch (...) {
+                CommandPool::Release(block);
+                throw;
+            }
+            this->storage_ = Storage::kPool;
+        } else {
+            this->command_ = new T(std::forward<Args>(args)...);
+            this->storage_ = Storage::kHeap;
+        }
+    }
+    void Reset() {
+        switch(this->storage_) {
+        case Storage::kInline:
+            this->command_->~Command();
+            break;
+        case Storage::kPool:
+            this->command_->~Command();
+            CommandPool::Release(this->command_);
+            break;
+        case Storage::kHeap:
+            delete this->command_;
+            break;
+        case Storage::kEmpty:
+            break;
+        }
+        this->command_ = nullptr;
+        this->storage_ = Storage::kEmpty;
+    }
+    explicit operator bool() const {
+        return this->command_ != nullptr;
+    }
+    void Execute() const {
+        this->command_->Execute();
+    }
+};
+// AsyncInvoker runs commands on a pool of worker threads instead of the
+// calling thread. Every worker owns a deque of tasks: it pops its own tasks
+// from the back and steals from the front of other deques when it runs dry.
+// Commands submitted from a worker go to that worker's own deque. Like
+// Invoker, it takes ownership of the commands and deletes them once executed.
+class AsyncInvoker {
+public:
+    // Called once the command has run, with the exception it threw, if any.
+    // An exception thrown by the completion itself is logged to cerr.
+    using Completion = std::function<void(std::exception_ptr)>;
+private:
+    struct Task {
+        Command* command;
+        Completion on_complete;
+    };
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        // Read without the lock, so that looking for work skips empty queues.
+        std::atomic<std::size_t> size{0};
+    };
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> next_queue_{0};
+    std::atomic<std::size_t> queued_{0};
+    std::atomic<std::size_t> sleepers_{0};
+    std::atomic<std::size_t> outstanding_{0};
+    std::atomic<bool> stop_{false};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    static thread_local AsyncInvoker* current_invoker_;
+    static thread_local std::size_t current_queue_;
+
+    bool TryPop(std::size_t index, Task& task) {
+        for(std::size_t i = 0; i < this->queues_.size(); i++) {
+            WorkQueue& queue = *this->queues_[(index + i) % this->queues_.size()];
+            if(queue.size == 0) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.tasks.empty()) {
+                continue;
+            }
+            queue.size--;
+            if(i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            this->queued_--;
+            return true;
+        }
+        return false;
+    }
+    void Run(std::size_t index) {
+        current_invoker_ = this;
+        current_queue_ = index;
+        Task task;
+        while(true) {
+            if(this->TryPop(index, task)) {
+                std::exception_ptr error;
+                try {
+                    task.command->Execute();
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                delete task.command;
+                if(task.on_complete) {
+                    try {
+                        task.on_complete(error);
+                    } catch(const std::exception& e) {
+                        std::cerr << "AsyncInvoker: Completion threw: " << e.what() << "\n";
+                    } catch(...) {
+                        std::cerr << "AsyncInvoker: Completion threw\n";
+                    }
+                }
+                task = Task();
+                if(--this->outstanding_ == 0) {
+                    std::lock_guard<std::mutex> lock(this->mutex_);
+                    this->done_.notify_all();
+                }
+                continue;
+            }
+            // Submit only takes the mutex to wake a sleeper. Counting the
+            // sleeper before checking queued_, while Submit counts the task
+            // before checking sleepers_, means one of them sees the other.
+            std::unique_lock<std::mutex> lock(this->mutex_);
+            this->sleepers_++;
+            this->wake_.wait(lock, [this] { return this->stop_ || this->queued_ > 0; });
+            this->sleepers_--;
+            if(this->stop_ && this->queued_ == 0) {
+                return;
+            }
+        }
+    }
+public:
+    explicit AsyncInvoker(std::size_t workers = std::thread::hardware_concurrency()) {
+        workers = std::max<std::size_t>(workers, 1);
+        for(std::size_t i = 0; i < workers; i++) {
+            this->queues_.push_back(std::make_unique<WorkQueue>());
+        }
+        for(std::size_t i = 0; i < workers; i++) {
+            this->workers_.emplace_back(&AsyncInvoker::Run, this, i);
+        }
+    }
+    // Runs the commands still queued before returning.
+    ~AsyncInvoker() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->stop_ = true;
+        }
+        this->wake_.notify_all();
+        for(std::thread& worker : this->workers_) {
+            worker.join();
+        }
+    }
+    void Submit(Command* command, Completion on_complete) {
+        std::size_t index = current_invoker_ == this ? current_queue_ : this->next_queue_++ % this->queues_.size();
+        this->outstanding_++;
+        // Counted before the task is visible, so that popping it can't take
+        // queued_ below zero.
+        std::size_t queued = ++this->queued_;
+        {
+            WorkQueue& queue = *this->queues_[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back({command, std::move(on_complete)});
+            queue.size++;
+        }
+        // Workers that are awake keep popping until queued_ is zero, so a
+        // sleeper is only woken when there are more tasks than awake workers.
+        std::size_t sleepers = this->sleepers_;
+        if(sleepers > 0 && queued > this->workers_.size() - sleepers) {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex_);
+            }
+            this->wake_.notify_one();
+        }
+    }
+    std::future<void> Submit(Command* command) {
+        auto promise = std::make_shared<std::promise<void>>();
+        std::future<void> future = promise->get_future();
+        this->Submit(command, [promise](std::exception_ptr error) {
+            if(error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value();
+            }
+        });
+        return future;
+    }
+    // Blocks until every submitted command has run.
+    void Wait() {
+        std::unique_lock<std::mutex> lock(this->mutex_);
+        this->done_.wait(lock, [this] { return this->outstanding_ == 0; });
+    }
+};
+thread_local AsyncInvoker* AsyncInvoker::current_invoker_ = nullptr;
+thread_local std::size_t AsyncInvoker::current_queue_ = 0;
+// A quiet command for benchmarking, it only counts its executions.
+class CountCommand : public Command {
+private:
+    std::atomic<std::size_t>* counter_;
+public:
+    explicit CountCommand(std::atomic<std::size_t>* counter) : counter_(counter) {}
+    void Execute() const override {
+        this->counter_->fetch_add(1, std::memory_order_relaxed);
+    }
+};
+// Measures the mean Submit latency and the tasks per second of AsyncInvoker
+// at 1 to 64 workers, against one std::async call per command.
+void BenchmarkAsyncInvoker() {
+    const std::size_t kTasks = 100000;
+    const std::size_t kAsyncTasks = 10000;
+    std::atomic<std::size_t> counter{0};
+    using Clock = std::chrono::steady_clock;
+    auto report = [](const std::string& name, std::size_t tasks, Clock::duration submit, Clock::duration total) {
+        std::cout << " " << name << ": submit "
+                  << std::chrono::duration<double, std::nano>(submit).count() / tasks << " ns, "
+                  << tasks / std::chrono::duration<double>(total).count() / 1e6 << " M tasks/s\n";
+    };
+    std::cout << "Benchmark: AsyncInvoker vs std::async\n";
+    {
+        std::vector<std::future<void>> futures;
+        futures.reserve(kAsyncTasks);
+        auto start = Clock::now();
+        for(std::size_t i = 0; i < kAsyncTasks; i++) {
+            futures.push_back(std::async(std::launch::async, [command = CountCommand(&counter)] { command.Execute(); }));
+        }
+        auto submitted = Clock::now();
+        for(std::future<void>& future : futures) {
+            future.wait();
+        }
+        report("std::async", kAsyncTasks, submitted - start, Clock::now() - start);
+    }
+    for(std::size_t workers : {1, 2, 4, 8, 16, 32, 64}) {
+        AsyncInvoker invoker(workers);
+        auto start = Clock::now();
+        for(std::size_t i = 0; i < kTasks; i++) {
+            invoker.Submit(new CountCommand(&counter), nullptr);
+        }
+        auto submitted = Clock::now();
+        invoker.Wait();
+        report(std::to_string(workers) + " workers", kTasks, submitted - start, Clock::now() - start);
+    }
+}
+// A command too large to be stored inline, it lands in the CommandPool.
+class WeightedCountCommand : public Command {
+private:
+    std::atomic<std::size_t>* counter_;
+    std::array<std::size_t, 20> weights_{};
+public:
+    explicit WeightedCountCommand(std::atomic<std::size_t>* counter) : counter_(counter) {
+        this->weights_[0] = 1;
+    }
+    void Execute() const override {
+        this->counter_->fetch_add(this->weights_[0], std::memory_order_relaxed);
+    }
+};
+// Creates, queues, executes and destroys commands in rounds, once through
+// new and Command* and once through InlineCommand, and reports the time and
+// heap allocations per command once the queue has reached its steady size.
+void BenchmarkInlineCommand() {
+    const std::size_t kRounds = 1000;
+    const std::size_t kCommands = 1000;
+    std::atomic<std::size_t> counter{0};
+    auto report = [](const char* name, auto&& round) {
+        round();
+        std::size_t allocations = g_allocations;
+        auto start = std::chrono::steady_clock::now();
+        for(std::size_t i = 0; i < kRounds; i++) {
+            round();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << " " << name << ": " << elapsed.count() / (kRounds * kCommands) << " ns, "
+                  << double(g_allocations - allocations) / (kRounds * kCommands) << " allocations per command\n";
+    };
+    std::cout << "Benchmark: new/delete commands vs InlineCommand\n";
+    std::vector<Command*> raw_queue;
+    std::vector<InlineCommand> inline_queue;
+    auto raw_round = [&]<typename T>() {
+        for(std::size_t i = 0; i < kCommands; i++) {
+            raw_queue.push_back(new T(&counter));
+        }
+        for(Command* command : raw_queue) {
+            command->Execute();
+            delete command;
+        }
+        raw_queue.clear();
+    };
+    auto inline_round = [&]<typename T>() {
+        for(std::size_t i = 0; i < kCommands; i++) {
+            inline_queue.emplace_back().Emplace<T>(&counter);
+        }
+        for(const InlineCommand& command : inline_queue) {
+            command.Execute();
+        }
+        inline_queue.clear();
+    };
+    report("new CountCommand", [&] { raw_round.operator()<CountCommand>(); });
+    report("inline CountCommand", [&] { inline_round.operator()<CountCommand>(); });
+    report("new WeightedCountCommand", [&] { raw_round.operator()<WeightedCountCommand>(); });
+    report("pooled WeightedCountCommand", [&] { inline_round.operator()<WeightedCountCommand>(); });
+}
+// Damages a small journal in several ways and checks that Replay rejects
+// each one instead of reading past the damage.
+bool CheckCorruptJournals() {
+    const std::string path = (std::filesystem::temp_directory_path() / "corrupt.journal").string();
+    Receiver receiver;
+    auto patch = [&](off_t offset, const void* bytes, std::size_t size) {
+        int fd = open(path.c_str(), O_WRONLY);
+        bool ok = fd >= 0 && pwrite(fd, bytes, size, offset) == static_cast<ssize_t>(size);
+        close(fd);
+        return ok;
+    };
+    const std::uint64_t past_end = std::uint64_t(1) << 40;
+    const std::uint8_t bad_type = 7;
+    const std::uint32_t bad_length = 0xfffffff0;
+    const std::function<bool()> damages[] = {
+        [&] { return truncate(path.c_str(), 100) == 0; },
+        [&] { return patch(8, &past_end, sizeof(past_end)); },
+        [&] { return patch(4096, &bad_type, sizeof(bad_type)); },
+        [&] { return patch(4097, &bad_length, sizeof(bad_length)); },
+    };
+    std::size_t rejected = 0;
+    for(std::size_t i = 0; i <= std::size(damages); i++) {
+        std::filesystem::remove(path);
+        {
+            CommandJournal journal(path, 16);
+            journal.Append(SimpleCommand("Say Hi!"));
+            journal.Append(ComplexCommand(&receiver, "Send Email", "Save Report"));
+        }
+        // The last round leaves the file intact but has no receiver to bind.
+        bool damaged = i == std::size(damages) || damages[i]();
+        try {
+            CommandJournal::Replay(path, i < std::size(damages) ? &receiver : nullptr, [](const Command&) {});
+        } catch(const std::exception&) {
+            rejected += damaged;
+        }
+    }
+    // Opening a small file which isn't a journal must neither grow it nor
+    // leave it open.
+    {
+        std::ofstream(path, std::ios::trunc) << "not a journal";
+    }
+    bool untouched = false;
+    try {
+        CommandJournal journal(path, 16);
+    } catch(const std::runtime_error&) {
+        untouched = std::filesystem::file_size(path) == 13;
+    }
+    std::filesystem::remove(path);
+    std::cout << "CommandJournal: rejected " << rejected << " of " << std::size(damages) + 1
+              << " damaged journals, a file which isn't one was " << (untouched ? "left as it was" : "changed")
+              << ".\n";
+    return rejected == std::size(damages) + 1 && untouched;
+}
+// Measures journal appends per second when syncing every N commands, then
+// replays a journal of ten million commands.
+void BenchmarkJournal() {
+    const std::size_t kAppends = 20000;
+    const std::size_t kReplayCommands = 10000000;
+    const std::string path = (std::filesystem::temp_directory_path() / "commands.journal").string();
+    Receiver receiver;
+    SimpleCommand simple("Say Hi!");
+    ComplexCommand complex(&receiver, "Send Email", "Save Report");
+    using Clock = std::chrono::steady_clock;
+    std::cout << "Benchmark: CommandJournal\n";
+    for(std::size_t group_size : {1, 16, 256, 4096}) {
+        std::filesystem::remove(path);
+        auto start = Clock::now();
+        {
+            CommandJournal journal(path, group_size);
+            for(std::size_t i = 0; i < kAppends; i++) {
+                journal.Append(i % 2 ? static_cast<const Command&>(complex) : simple);
+            }
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        std::cout << " sync every " << group_size << ": " << kAppends / elapsed.count() / 1e3 << " K appends/s\n";
+    }
+    std::filesystem::remove(path);
+    {
+        CommandJournal journal(path, 65536);
+        for(std::size_t i = 0; i < kReplayCommands; i++) {
+            journal.Append(i % 2 ? static_cast<const Command&>(complex) : simple);
+        }
+    }
+    std::size_t simple_commands = 0;
+    auto start = Clock::now();
+    std::size_t replayed = CommandJournal::Replay(path, &receiver, [&](const Command& command) {
+        simple_commands += dynamic_cast<const SimpleCommand*>(&command) != nullptr;
+    });
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    std::cout << " replay: " << replayed << " commands (" << std::filesystem::file_size(path) / (1 << 20)
+              << " MiB) at " << replayed / elapsed.count() / 1e6 << " M commands/s\n";
+    std::filesystem::remove(path);
+}
 int main() {
     Invoker* invoker = new Invoker();
     invoker->SetOnStart(new SimpleCommand("Say Hi!"));
@@ -88,6 +991,54 @@ int main() {
     invoker->DoSomethingImportant();
 
     delete invoker;
+
+    std::cout << "\n";
+    CommandBuffer buffer(8, std::chrono::milliseconds(10));
+    buffer.set_trace(&std::cout);
+    std::cout << "Client: Recording commands into a CommandBuffer.\n";
+    buffer.Record(new SimpleCommand("Say Hi!"));
+    buffer.Record(new ComplexCommand(receiver, "Send Email", "Save Report"));
+    buffer.Record(new ComplexCommand(receiver, "Send Fax", "Print Report"));
+    buffer.Record(new ComplexCommand(receiver, "Send Letter", "File Report"));
+    buffer.Record(new AuditedCommand(receiver, "Send Invoice", "Archive Report"));
+    buffer.Record(new SimpleCommand("Say Bye!"));
+    buffer.Flush();
+    std::cout << "CommandBuffer: " << buffer.counters().commands << " commands in "
+              << buffer.counters().batches << " batch, average batch size "
+              << buffer.counters().AverageBatchSize() << ", coalescing ratio "
+              << buffer.counters().CoalescingRatio() << "\n";
+
+    std::cout << "\n";
+    const std::string journal_path = (std::filesystem::temp_directory_path() / "demo.journal").string();
+    std::filesystem::remove(journal_path);
+    {
+        CommandJournal journal(journal_path, 16);
+        journal.Append(SimpleCommand("Say Hi!"));
+        journal.Append(ComplexCommand(receiver, "Send Email", "Save Report"));
+        journal.Close();
+    }
+    std::cout << "Client: Replaying the CommandJournal.\n";
+    CommandJournal::Replay(journal_path, receiver);
+    std::filesystem::remove(journal_path);
+    bool passed = CheckCorruptJournals();
+
+    std::cout << "\n";
+    AsyncInvoker async_invoker(2);
+    std::cout << "Client: Handing commands over to the AsyncInvoker.\n";
+    async_invoker.Submit(new SimpleCommand("Say Hi!")).wait();
+    async_invoker.Submit(new ComplexCommand(receiver, "Send Email", "Save Report")).wait();
+    // A completion that throws is logged and the worker carries on.
+    async_invoker.Submit(new SimpleCommand("Say Bye!"), [](std::exception_ptr) {
+        throw std::runtime_error("completion failed");
+    });
+    async_invoker.Wait();
     delete receiver;
-    return 0;
+
+    std::cout << "\n";
+    BenchmarkAsyncInvoker();
+    std::cout << "\n";
+    BenchmarkInlineCommand();
+    std::cout << "\n";
+    BenchmarkJournal();
+    return passed ? 0 : 1;
 }
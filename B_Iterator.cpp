@@ -12,34 +12,177 @@
     position and how many elements are left till the end. Because of this
     several iterators can go through same collection independently.
 */
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <ranges>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 template<typename T, typename U>
 class Iterator {
 public:
     typedef typename std::vector<T>::iterator iter_type;
-    Iterator(U* p_data, bool reverse = false) : m_p_data_(p_data) {
-        m_it_ = m_p_data_->m_data_.begin();
+    Iterator(U* p_data, bool reverse = false) : m_p_data_(p_data), m_reverse_(reverse) {
+        First();
     }
+    // In reverse, m_it_ points one past the current element.
     void First() {
-        m_it_ = m_p_data_->m_data_.begin();
+        m_it_ = m_reverse_ ? m_p_data_->m_data_.end() : m_p_data_->m_data_.begin();
     }
     void Next() {
-        m_it_++;
+        if(m_reverse_) {
+            m_it_--;
+        } else {
+            m_it_++;
+        }
     }
     bool IsDone() {
-        return (m_it_ == m_p_data_->m_data_.end());
+        return (m_it_ == (m_reverse_ ? m_p_data_->m_data_.begin() : m_p_data_->m_data_.end()));
     }
     iter_type Current() {
-        return m_it_;
+        return m_reverse_ ? std::prev(m_it_) : m_it_;
     }
 private:
     U* m_p_data_;
+    bool m_reverse_;
     iter_type m_it_;
 };
+// Stack-allocated iterator over the contiguous storage of a Container. It is
+// a plain pointer underneath, so loops over it compile down to pointer loops
+// which the compiler can vectorize, and it works with the std::ranges algorithms.
+template<typename T>
+class ContiguousIterator {
+public:
+    using iterator_concept = std::contiguous_iterator_tag;
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = std::remove_cv_t<T>;
+    using element_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+    ContiguousIterator() = default;
+    explicit ContiguousIterator(T* p) : m_p_(p) {}
+    // An iterator converts to a const_iterator, not the other way round.
+    template<typename U> requires std::is_same_v<const U, T> && (!std::is_same_v<U, T>)
+    ContiguousIterator(ContiguousIterator<U> other) : m_p_(other.m_p_) {}
+    T& operator*() const { return *m_p_; }
+    T* operator->() const { return m_p_; }
+    T& operator[](difference_type n) const { return m_p_[n]; }
+    ContiguousIterator& operator++() { ++m_p_; return *this; }
+    ContiguousIterator operator++(int) { return ContiguousIterator(m_p_++); }
+    ContiguousIterator& operator--() { --m_p_; return *this; }
+    ContiguousIterator operator--(int) { return ContiguousIterator(m_p_--); }
+    ContiguousIterator& operator+=(difference_type n) { m_p_ += n; return *this; }
+    ContiguousIterator& operator-=(difference_type n) { m_p_ -= n; return *this; }
+    friend ContiguousIterator operator+(ContiguousIterator it, difference_type n) { return it += n; }
+    friend ContiguousIterator operator+(difference_type n, ContiguousIterator it) { return it += n; }
+    friend ContiguousIterator operator-(ContiguousIterator it, difference_type n) { return it -= n; }
+    friend difference_type operator-(ContiguousIterator a, ContiguousIterator b) { return a.m_p_ - b.m_p_; }
+    friend bool operator==(ContiguousIterator a, ContiguousIterator b) { return a.m_p_ == b.m_p_; }
+    friend auto operator<=>(ContiguousIterator a, ContiguousIterator b) { return a.m_p_ <=> b.m_p_; }
+private:
+    template<typename> friend class ContiguousIterator;
+    T* m_p_ = nullptr;
+};
+// Visits every step-th element. Positions are kept as indices, so the end
+// position never forms a pointer past the storage.
+template<typename T>
+class StridedIterator {
+public:
+    using iterator_concept = std::random_access_iterator_tag;
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = std::remove_cv_t<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using reference = T&;
+    StridedIterator() = default;
+    StridedIterator(T* base, difference_type index, difference_type step) : m_base_(base), m_index_(index), m_step_(step) {}
+    template<typename U> requires std::is_same_v<const U, T> && (!std::is_same_v<U, T>)
+    StridedIterator(StridedIterator<U> other) : m_base_(other.m_base_), m_index_(other.m_index_), m_step_(other.m_step_) {}
+    T& operator*() const { return m_base_[m_index_]; }
+    T& operator[](difference_type n) const { return m_base_[m_index_ + n * m_step_]; }
+    StridedIterator& operator++() { m_index_ += m_step_; return *this; }
+    StridedIterator operator++(int) { StridedIterator it = *this; ++*this; return it; }
+    StridedIterator& operator--() { m_index_ -= m_step_; return *this; }
+    StridedIterator operator--(int) { StridedIterator it = *this; --*this; return it; }
+    StridedIterator& operator+=(difference_type n) { m_index_ += n * m_step_; return *this; }
+    StridedIterator& operator-=(difference_type n) { m_index_ -= n * m_step_; return *this; }
+    friend StridedIterator operator+(StridedIterator it, difference_type n) { return it += n; }
+    friend StridedIterator operator+(difference_type n, StridedIterator it) { return it += n; }
+    friend StridedIterator operator-(StridedIterator it, difference_type n) { return it -= n; }
+    friend difference_type operator-(StridedIterator a, StridedIterator b) { return (a.m_index_ - b.m_index_) / a.m_step_; }
+    friend bool operator==(StridedIterator a, StridedIterator b) { return a.m_index_ == b.m_index_; }
+    friend auto operator<=>(StridedIterator a, StridedIterator b) { return a.m_index_ <=> b.m_index_; }
+private:
+    template<typename> friend class StridedIterator;
+    T* m_base_ = nullptr;
+    std::ptrdiff_t m_index_ = 0;
+    std::ptrdiff_t m_step_ = 1;
+};
 
+// Splits contiguous storage into chunks of about chunk_size elements whose
+// boundaries fall on cache line boundaries, so that threads working on
+// neighbouring chunks never write to the same cache line. The first chunk
+// absorbs the unaligned head of the storage.
+template<typename T>
+class ChunkRange {
+public:
+    static constexpr std::size_t kCacheLine = 64;
+    ChunkRange(T* begin, T* end, std::size_t chunk_size) : m_begin_(begin), m_end_(end) {
+        std::size_t per_line = (kCacheLine % sizeof(T) == 0) ? kCacheLine / sizeof(T) : 1;
+        m_chunk_size_ = (std::max<std::size_t>(chunk_size, 1) + per_line - 1) / per_line * per_line;
+        std::uintptr_t address = reinterpret_cast<std::uintptr_t>(begin);
+        std::size_t skip = per_line > 1 ? ((kCacheLine - address % kCacheLine) % kCacheLine) / sizeof(T) : 0;
+        m_head_ = std::min<std::size_t>(skip, end - begin);
+    }
+    std::size_t size() const {
+        std::size_t n = m_end_ - m_begin_;
+        if(n == 0) {
+            return 0;
+        }
+        std::size_t first = std::min(n, m_head_ + m_chunk_size_);
+        return 1 + (n - first + m_chunk_size_ - 1) / m_chunk_size_;
+    }
+    std::span<T> operator[](std::size_t i) const {
+        std::size_t n = m_end_ - m_begin_;
+        std::size_t from = i == 0 ? 0 : m_head_ + i * m_chunk_size_;
+        std::size_t to = std::min(n, m_head_ + (i + 1) * m_chunk_size_);
+        return std::span<T>(m_begin_ + from, m_begin_ + to);
+    }
+    // Splits the range into two halves at a chunk boundary.
+    std::pair<ChunkRange, ChunkRange> Split() const {
+        T* middle = m_begin_ + std::min<std::size_t>(m_head_ + size() / 2 * m_chunk_size_, m_end_ - m_begin_);
+        if(size() < 2) {
+            middle = m_end_;
+        }
+        return {ChunkRange(m_begin_, middle, m_chunk_size_), ChunkRange(middle, m_end_, m_chunk_size_)};
+    }
+private:
+    T* m_begin_;
+    T* m_end_;
+    std::size_t m_chunk_size_;
+    std::size_t m_head_;
+};
 template<class T> 
 class Container {
     friend class Iterator<T, Container>;
@@ -47,12 +190,206 @@ public:
     void Add(T a) {
         m_data_.push_back(a);
     }
-    Iterator<T, Container>* CreateIterator() {
-        return new Iterator<T, Container>(this);
+    Iterator<T, Container>* CreateIterator(bool reverse = false) {
+        return new Iterator<T, Container>(this, reverse);
+    }
+    typedef ContiguousIterator<T> iterator;
+    typedef ContiguousIterator<const T> const_iterator;
+    iterator begin() {
+        return iterator(m_data_.data());
+    }
+    iterator end() {
+        return iterator(m_data_.data() + m_data_.size());
+    }
+    const_iterator begin() const {
+        return const_iterator(m_data_.data());
+    }
+    const_iterator end() const {
+        return const_iterator(m_data_.data() + m_data_.size());
+    }
+    std::size_t size() const {
+        return m_data_.size();
+    }
+    auto Reverse() {
+        return std::ranges::subrange(std::make_reverse_iterator(end()), std::make_reverse_iterator(begin()));
+    }
+    auto Reverse() const {
+        return std::ranges::subrange(std::make_reverse_iterator(end()), std::make_reverse_iterator(begin()));
+    }
+    // Every step-th element, starting with the first one. The step must be positive.
+    auto Strided(std::ptrdiff_t step) {
+        return MakeStrided(m_data_.data(), m_data_.size(), step);
+    }
+    auto Strided(std::ptrdiff_t step) const {
+        return MakeStrided(m_data_.data(), m_data_.size(), step);
+    }
+    ChunkRange<T> Chunks(std::size_t chunk_size = 16384) {
+        return ChunkRange<T>(m_data_.data(), m_data_.data() + m_data_.size(), chunk_size);
     }
 private:
     std::vector<T> m_data_;
+
+    template<typename E>
+    static auto MakeStrided(E* data, std::size_t size, std::ptrdiff_t step) {
+        if(step <= 0) {
+            throw std::invalid_argument("Container: stride must be positive");
+        }
+        std::ptrdiff_t last = (std::ptrdiff_t(size) + step - 1) / step * step;
+        return std::ranges::subrange(StridedIterator<E>(data, 0, step), StridedIterator<E>(data, last, step));
+    }
+};
+// Fork-join pool. ParallelFor hands out indices in contiguous blocks, one
+// deque per participant; each takes from the front of its own deque and
+// steals from the back of the others. The calling thread participates too.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(std::size_t threads) {
+        threads = std::max<std::size_t>(threads, 1);
+        for(std::size_t i = 0; i < threads; i++) {
+            m_queues_.push_back(std::make_unique<Queue>());
+        }
+        for(std::size_t i = 1; i < threads; i++) {
+            m_workers_.emplace_back(&WorkStealingPool::Run, this, i);
+        }
+    }
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex_);
+            m_stop_ = true;
+        }
+        m_wake_.notify_all();
+        for(std::thread& worker : m_workers_) {
+            worker.join();
+        }
+    }
+    std::size_t size() const {
+        return m_queues_.size();
+    }
+    // Runs job(i) for every i in [0, count) and returns once all have run.
+    // Only one thread at a time may call it.
+    void ParallelFor(std::size_t count, const std::function<void(std::size_t)>& job) {
+        if(count == 0) {
+            return;
+        }
+        // The count is published before any index, since a worker still
+        // draining the previous call may take an index as soon as it is pushed.
+        {
+            std::lock_guard<std::mutex> lock(m_mutex_);
+            m_remaining_ = count;
+            m_generation_++;
+        }
+        std::size_t per_queue = (count + m_queues_.size() - 1) / m_queues_.size();
+        for(std::size_t q = 0; q < m_queues_.size(); q++) {
+            std::lock_guard<std::mutex> lock(m_queues_[q]->mutex);
+            for(std::size_t i = q * per_queue; i < std::min(count, (q + 1) * per_queue); i++) {
+                m_queues_[q]->items.push_back({&job, i});
+            }
+        }
+        m_wake_.notify_all();
+        Drain(0);
+        std::unique_lock<std::mutex> lock(m_mutex_);
+        m_done_.wait(lock, [this] { return m_remaining_ == 0; });
+    }
+private:
+    // Each task carries its job, so a worker never reads a job of another call.
+    struct Task {
+        const std::function<void(std::size_t)>* job;
+        std::size_t index;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> items;
+    };
+    std::vector<std::unique_ptr<Queue>> m_queues_;
+    std::vector<std::thread> m_workers_;
+    std::mutex m_mutex_;
+    std::condition_variable m_wake_;
+    std::condition_variable m_done_;
+    std::size_t m_remaining_ = 0;
+    std::uint64_t m_generation_ = 0;
+    bool m_stop_ = false;
+
+    bool TryTake(std::size_t self, Task& task) {
+        for(std::size_t i = 0; i < m_queues_.size(); i++) {
+            Queue& queue = *m_queues_[(self + i) % m_queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.items.empty()) {
+                continue;
+            }
+            if(i == 0) {
+                task = queue.items.front();
+                queue.items.pop_front();
+            } else {
+                task = queue.items.back();
+                queue.items.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+    void Drain(std::size_t self) {
+        Task task;
+        while(TryTake(self, task)) {
+            // A taken task keeps its job alive until m_remaining_ drops.
+            (*task.job)(task.index);
+            std::lock_guard<std::mutex> lock(m_mutex_);
+            if(--m_remaining_ == 0) {
+                m_done_.notify_all();
+            }
+        }
+    }
+    void Run(std::size_t self) {
+        std::uint64_t seen = 0;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex_);
+                m_wake_.wait(lock, [&] { return m_stop_ || m_generation_ != seen; });
+                if(m_stop_) {
+                    return;
+                }
+                seen = m_generation_;
+            }
+            Drain(self);
+        }
+    }
 };
+// Applies f to every element, one chunk per task.
+template<typename T, typename F>
+void ParallelForEach(WorkStealingPool& pool, Container<T>& cont, F&& f, std::size_t chunk_size = 16384) {
+    ChunkRange<T> chunks = cont.Chunks(chunk_size);
+    pool.ParallelFor(chunks.size(), [&](std::size_t i) {
+        for(T& a : chunks[i]) {
+            f(a);
+        }
+    });
+}
+// Reduces every chunk from identity, then combines the partial results in
+// chunk order. Chunking doesn't depend on the number of threads, so for an
+// associative op the result is the same however the chunks were scheduled.
+template<typename T, typename R, typename Op>
+R ParallelReduce(WorkStealingPool& pool, Container<T>& cont, R identity, Op op, std::size_t chunk_size = 16384) {
+    ChunkRange<T> chunks = cont.Chunks(chunk_size);
+    std::vector<R> partials(chunks.size(), identity);
+    pool.ParallelFor(chunks.size(), [&](std::size_t i) {
+        R partial = identity;
+        for(const T& a : chunks[i]) {
+            partial = op(partial, a);
+        }
+        partials[i] = partial;
+    });
+    R result = identity;
+    for(const R& partial : partials) {
+        result = op(result, partial);
+    }
+    return result;
+}
+static_assert(std::contiguous_iterator<ContiguousIterator<int>>);
+static_assert(std::ranges::contiguous_range<Container<int>>);
+static_assert(std::ranges::random_access_range<decltype(std::declval<Container<int>&>().Strided(2))>);
+static_assert(std::ranges::random_access_range<decltype(std::declval<const Container<int>&>().Strided(2))>);
+static_assert(std::convertible_to<Container<int>::iterator, Container<int>::const_iterator>);
+static_assert(!std::convertible_to<Container<int>::const_iterator, Container<int>::iterator>);
+static_assert(std::convertible_to<StridedIterator<int>, StridedIterator<const int>>);
 class Data {
 public:
     Data(int a = 0) : m_data_(a) {}
@@ -65,15 +402,273 @@ public:
 private:
     int m_data_;
 };
+// Describes how an aggregate element splits into fields for SoAContainer.
+// Specializations provide the Fields tuple, Split and Join.
+template<typename T>
+struct SoATraits;
+template<>
+struct SoATraits<Data> {
+    using Fields = std::tuple<int>;
+    static Fields Split(const Data& d) {
+        return {d.data()};
+    }
+    static Data Join(int data) {
+        return Data(data);
+    }
+};
+// Structure-of-arrays storage: each field of T lives in its own contiguous
+// array, so a traversal touching one field streams only that field's array.
+// Iterators yield proxy references, which read single fields with get<I>()
+// or rebuild the whole element by converting to T.
+template<typename T>
+class SoAContainer {
+private:
+    typedef SoATraits<T> Traits;
+    typedef typename Traits::Fields Fields;
+    static constexpr std::size_t kFields = std::tuple_size_v<Fields>;
+    template<typename Tuple> struct ColumnsOf;
+    template<typename... Fs> struct ColumnsOf<std::tuple<Fs...>> {
+        typedef std::tuple<std::vector<Fs>...> type;
+    };
+    typename ColumnsOf<Fields>::type m_columns_;
+public:
+    template<std::size_t I>
+    using field_type = std::tuple_element_t<I, Fields>;
+    class Reference {
+    public:
+        Reference(SoAContainer* p_data, std::size_t index) : m_p_data_(p_data), m_index_(index) {}
+        template<std::size_t I>
+        field_type<I>& get() const {
+            return std::get<I>(m_p_data_->m_columns_)[m_index_];
+        }
+        operator T() const {
+            return [this]<std::size_t... I>(std::index_sequence<I...>) {
+                return Traits::Join(get<I>()...);
+            }(std::make_index_sequence<kFields>{});
+        }
+    private:
+        SoAContainer* m_p_data_;
+        std::size_t m_index_;
+    };
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = Reference;
+        iterator(SoAContainer* p_data, std::size_t index) : m_p_data_(p_data), m_index_(index) {}
+        Reference operator*() const { return Reference(m_p_data_, m_index_); }
+        iterator& operator++() { ++m_index_; return *this; }
+        iterator operator++(int) { iterator it = *this; ++m_index_; return it; }
+        friend bool operator==(const iterator& a, const iterator& b) { return a.m_index_ == b.m_index_; }
+    private:
+        SoAContainer* m_p_data_;
+        std::size_t m_index_;
+    };
+    void Add(const T& a) {
+        Fields fields = Traits::Split(a);
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+            (std::get<I>(m_columns_).push_back(std::move(std::get<I>(fields))), ...);
+        }(std::make_index_sequence<kFields>{});
+    }
+    std::size_t size() const {
+        return std::get<0>(m_columns_).size();
+    }
+    iterator begin() {
+        return iterator(this, 0);
+    }
+    iterator end() {
+        return iterator(this, size());
+    }
+    // The contiguous array holding field I of every element.
+    template<std::size_t I>
+    std::span<const field_type<I>> Column() const {
+        return std::get<I>(m_columns_);
+    }
+};
+// An element type whose size grows with N, for comparing the layouts.
+template<std::size_t N>
+struct Record {
+    int key;
+    std::array<int, N> payload;
+};
+template<std::size_t N>
+struct SoATraits<Record<N>> {
+    using Fields = std::tuple<int, std::array<int, N>>;
+    static Fields Split(const Record<N>& r) {
+        return {r.key, r.payload};
+    }
+    static Record<N> Join(int key, const std::array<int, N>& payload) {
+        return {key, payload};
+    }
+};
+// A tree kept in flat arrays, laid out in breadth-first order so that the
+// children of a node are adjacent. Every node stores only its parent and its
+// first child; the next sibling is simply the next node if it has the same
+// parent. Breadth-first traversal is a linear scan and depth-first traversals
+// walk the index arrays without a stack, so no traversal allocates.
+template<typename T>
+class FlatTree {
+public:
+    static constexpr std::uint32_t kNone = UINT32_MAX;
+    // Collects nodes in any order, Build lays them out. Each root added
+    // starts another tree of a forest. Depth-first traversals go through the
+    // trees one after the other in the order the roots were added,
+    // breadth-first goes level by level across all of them.
+    class Builder {
+    public:
+        std::uint32_t AddRoot(T value) {
+            return AddNode(kNone, std::move(value));
+        }
+        std::uint32_t AddChild(std::uint32_t parent, T value) {
+            if(parent >= m_values_.size()) {
+                throw std::out_of_range("FlatTree: no such parent node");
+            }
+            std::uint32_t node = AddNode(parent, std::move(value));
+            m_children_[parent].push_back(node);
+            return node;
+        }
+        FlatTree Build() {
+            FlatTree tree;
+            if(m_values_.empty()) {
+                return tree;
+            }
+            std::vector<std::uint32_t> order;
+            for(std::uint32_t node = 0; node < m_values_.size(); node++) {
+                if(m_parents_[node] == kNone) {
+                    order.push_back(node);
+                }
+            }
+            std::vector<std::uint32_t> position(m_values_.size());
+            for(std::size_t i = 0; i < order.size(); i++) {
+                position[order[i]] = i;
+                for(std::uint32_t child : m_children_[order[i]]) {
+                    order.push_back(child);
+                }
+            }
+            for(std::uint32_t node : order) {
+                tree.m_values_.push_back(std::move(m_values_[node]));
+                tree.m_parent_.push_back(m_parents_[node] == kNone ? kNone : position[m_parents_[node]]);
+                tree.m_first_child_.push_back(m_children_[node].empty() ? kNone : position[m_children_[node][0]]);
+            }
+            return tree;
+        }
+    private:
+        std::vector<T> m_values_;
+        std::vector<std::uint32_t> m_parents_;
+        std::vector<std::vector<std::uint32_t>> m_children_;
+
+        std::uint32_t AddNode(std::uint32_t parent, T value) {
+            m_values_.push_back(std::move(value));
+            m_parents_.push_back(parent);
+            m_children_.emplace_back();
+            return m_values_.size() - 1;
+        }
+    };
+    enum class Order { kPreOrder, kPostOrder, kBreadthFirst };
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+        iterator() = default;
+        iterator(const FlatTree* tree, std::uint32_t node, Order order) : m_tree_(tree), m_node_(node), m_order_(order) {}
+        const T& operator*() const { return m_tree_->m_values_[m_node_]; }
+        const T* operator->() const { return &m_tree_->m_values_[m_node_]; }
+        std::uint32_t index() const { return m_node_; }
+        iterator& operator++() {
+            switch(m_order_) {
+            case Order::kBreadthFirst:
+                m_node_ = m_node_ + 1 < m_tree_->size() ? m_node_ + 1 : kNone;
+                break;
+            case Order::kPreOrder:
+                m_node_ = m_tree_->NextPreOrder(m_node_);
+                break;
+            case Order::kPostOrder:
+                m_node_ = m_tree_->NextPostOrder(m_node_);
+                break;
+            }
+            return *this;
+        }
+        iterator operator++(int) { iterator it = *this; ++*this; return it; }
+        friend bool operator==(const iterator& a, const iterator& b) { return a.m_node_ == b.m_node_; }
+    private:
+        const FlatTree* m_tree_ = nullptr;
+        std::uint32_t m_node_ = kNone;
+        Order m_order_ = Order::kBreadthFirst;
+    };
+    std::size_t size() const {
+        return m_values_.size();
+    }
+    auto PreOrder() const {
+        return Traversal(size() ? 0 : kNone, Order::kPreOrder);
+    }
+    auto PostOrder() const {
+        return Traversal(size() ? LeftmostLeaf(0) : kNone, Order::kPostOrder);
+    }
+    auto BreadthFirst() const {
+        return Traversal(size() ? 0 : kNone, Order::kBreadthFirst);
+    }
+private:
+    std::vector<T> m_values_;
+    std::vector<std::uint32_t> m_parent_;
+    std::vector<std::uint32_t> m_first_child_;
+
+    auto Traversal(std::uint32_t first, Order order) const {
+        return std::ranges::subrange(iterator(this, first, order), iterator(this, kNone, order));
+    }
+    // Roots share the parent kNone, so they are siblings of each other.
+    std::uint32_t NextSibling(std::uint32_t node) const {
+        return node + 1 < size() && m_parent_[node + 1] == m_parent_[node] ? node + 1 : kNone;
+    }
+    std::uint32_t LeftmostLeaf(std::uint32_t node) const {
+        while(m_first_child_[node] != kNone) {
+            node = m_first_child_[node];
+        }
+        return node;
+    }
+    std::uint32_t NextPreOrder(std::uint32_t node) const {
+        if(m_first_child_[node] != kNone) {
+            return m_first_child_[node];
+        }
+        for(; node != kNone; node = m_parent_[node]) {
+            std::uint32_t sibling = NextSibling(node);
+            if(sibling != kNone) {
+                return sibling;
+            }
+        }
+        return kNone;
+    }
+    std::uint32_t NextPostOrder(std::uint32_t node) const {
+        std::uint32_t sibling = NextSibling(node);
+        return sibling != kNone ? LeftmostLeaf(sibling) : m_parent_[node];
+    }
+};
 void ClientCode() {
     std::cout << "________Iterator with Int__________" << std::endl;
     Container<int> cont;
     for(int i=0; i<10; i++) {
         cont.Add(i);
     }
-    Iterator<int, Container<int>>* it = cont.CreateIterator();
-    for(it->First(); !it->IsDone(); it->Next()) {
-        std::cout << *it->Current() << std::endl;
+    for(int i : cont) {
+        std::cout << i << std::endl;
+    }
+    std::cout << "________Reverse and every third Int__________" << std::endl;
+    for(int i : cont.Reverse()) {
+        std::cout << i << " ";
+    }
+    std::cout << std::endl;
+    const Container<int>& view = cont;
+    for(int i : view.Strided(3)) {
+        std::cout << i << " ";
+    }
+    std::cout << std::endl;
+    try {
+        cont.Strided(0);
+    } catch(const std::invalid_argument& e) {
+        std::cout << "Strided(0) rejected: " << e.what() << std::endl;
     }
 
     Container<Data> cont2;
@@ -82,14 +677,245 @@ void ClientCode() {
     cont2.Add(b);
     cont2.Add(c);
     std::cout << "___________Iterator with custom class_____________" << std::endl;
-    Iterator<Data, Container<Data>>* it2 = cont2.CreateIterator();
+    for(const Data& d : cont2) {
+        std::cout << d.data() << std::endl;
+    }
+    std::cout << "___________Heap Iterator in reverse_____________" << std::endl;
+    Iterator<Data, Container<Data>>* it2 = cont2.CreateIterator(true);
     for(it2->First(); !it2->IsDone(); it2->Next()) {
         std::cout << it2->Current()->data() << std::endl;
     }
-    delete it;
     delete it2;
+
+    std::cout << "___________SoA Iterator with custom class_____________" << std::endl;
+    SoAContainer<Data> cont3;
+    cont3.Add(a);
+    cont3.Add(b);
+    cont3.Add(c);
+    for(Data d : cont3) {
+        std::cout << d.data() << std::endl;
+    }
+    std::span<const int> column = cont3.Column<0>();
+    std::cout << "Sum of the data column: " << std::accumulate(column.begin(), column.end(), 0) << std::endl;
+
+    std::cout << "___________Parallel Iterator over Int chunks_____________" << std::endl;
+    WorkStealingPool pool(2);
+    ParallelForEach(pool, cont, [](int& i) { i *= 2; }, 4);
+    std::cout << "Sum of doubled ints: " << ParallelReduce(pool, cont, 0, std::plus<>(), 4) << std::endl;
+
+    std::cout << "___________Tree Iterators_____________" << std::endl;
+    // 1 has children 2 and 3, 2 has children 4 and 5, 3 has child 6.
+    FlatTree<int>::Builder builder;
+    std::uint32_t root = builder.AddRoot(1);
+    std::uint32_t two = builder.AddChild(root, 2);
+    std::uint32_t three = builder.AddChild(root, 3);
+    builder.AddChild(two, 4);
+    builder.AddChild(two, 5);
+    builder.AddChild(three, 6);
+    // A second root 7 with child 8 makes the tree a forest.
+    builder.AddChild(builder.AddRoot(7), 8);
+    try {
+        builder.AddChild(100, 9);
+    } catch(const std::out_of_range& e) {
+        std::cout << "AddChild(100) rejected: " << e.what() << std::endl;
+    }
+    FlatTree<int> tree = builder.Build();
+    std::cout << "Pre-order: ";
+    for(int i : tree.PreOrder()) {
+        std::cout << i << " ";
+    }
+    std::cout << std::endl << "Post-order: ";
+    for(int i : tree.PostOrder()) {
+        std::cout << i << " ";
+    }
+    std::cout << std::endl << "Breadth-first: ";
+    for(int i : tree.BreadthFirst()) {
+        std::cout << i << " ";
+    }
+    std::cout << std::endl;
+}
+// Sums 100M ints once through the heap allocated Iterator and once through
+// the contiguous one.
+void BenchmarkSum() {
+    const int kElements = 100000000;
+    Container<int> cont;
+    for(int i = 0; i < kElements; i++) {
+        cont.Add(i & 0xff);
+    }
+    auto measure = [](const char* name, auto&& sum) {
+        auto start = std::chrono::steady_clock::now();
+        std::int64_t total = sum();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << " " << name << ": " << elapsed.count() << " ms (sum " << total << ")" << std::endl;
+    };
+    std::cout << "Benchmark: summing " << kElements << " ints" << std::endl;
+    measure("Iterator", [&] {
+        std::int64_t total = 0;
+        Iterator<int, Container<int>>* it = cont.CreateIterator();
+        for(it->First(); !it->IsDone(); it->Next()) {
+            total += *it->Current();
+        }
+        delete it;
+        return total;
+    });
+    measure("ContiguousIterator", [&] {
+        std::int64_t total = 0;
+        for(int i : cont) {
+            total += i;
+        }
+        return total;
+    });
+}
+// Compares AoS and SoA layouts of Record<N> for a scan reading only the key
+// and a scan reading whole records, as the record grows.
+template<std::size_t N>
+void BenchmarkLayout() {
+    const int kElements = 1 << 20;
+    Container<Record<N>> aos;
+    SoAContainer<Record<N>> soa;
+    for(int i = 0; i < kElements; i++) {
+        Record<N> r{i & 0xff, {}};
+        r.payload.fill(1);
+        aos.Add(r);
+        soa.Add(r);
+    }
+    auto measure = [](auto&& scan) {
+        auto start = std::chrono::steady_clock::now();
+        volatile std::int64_t total = scan();
+        (void)total;
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    double aos_key = measure([&] {
+        std::int64_t total = 0;
+        for(const Record<N>& r : aos) {
+            total += r.key;
+        }
+        return total;
+    });
+    double soa_key = measure([&] {
+        std::int64_t total = 0;
+        for(int key : soa.template Column<0>()) {
+            total += key;
+        }
+        return total;
+    });
+    double aos_full = measure([&] {
+        std::int64_t total = 0;
+        for(const Record<N>& r : aos) {
+            total += r.key + std::accumulate(r.payload.begin(), r.payload.end(), 0);
+        }
+        return total;
+    });
+    double soa_full = measure([&] {
+        std::int64_t total = 0;
+        for(auto r : soa) {
+            const std::array<int, N>& payload = r.template get<1>();
+            total += r.template get<0>() + std::accumulate(payload.begin(), payload.end(), 0);
+        }
+        return total;
+    });
+    std::cout << " " << sizeof(Record<N>) << " byte records: key scan AoS " << aos_key << " ms, SoA " << soa_key
+              << " ms; full scan AoS " << aos_full << " ms, SoA " << soa_full << " ms" << std::endl;
+}
+// Runs many tiny back-to-back ParallelFor calls on more threads than there
+// are indices, so workers still draining one call meet the next one.
+bool StressPool() {
+    const std::size_t kCalls = 50000;
+    WorkStealingPool pool(4);
+    std::atomic<std::size_t> sum{0};
+    std::size_t mismatches = 0;
+    for(std::size_t call = 0; call < kCalls; call++) {
+        sum = 0;
+        pool.ParallelFor(3, [&](std::size_t i) { sum += i + 1; });
+        mismatches += sum != 6;
+    }
+    std::cout << "Stress: " << kCalls << " back-to-back ParallelFor calls on 4 threads, "
+              << mismatches << " wrong sums" << std::endl;
+    return mismatches == 0;
+}
+// Times ParallelReduce over containers of 10^6 to 10^8 ints with 1 up to
+// hardware_concurrency threads, checking that every run gives the same sum.
+void BenchmarkParallelReduce() {
+    std::size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Benchmark: ParallelReduce scaling" << std::endl;
+    for(std::size_t elements : {1000000, 10000000, 100000000}) {
+        Container<int> cont;
+        for(std::size_t i = 0; i < elements; i++) {
+            cont.Add(int(i & 0xff));
+        }
+        std::int64_t expected = 0;
+        for(std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+            WorkStealingPool pool(threads);
+            auto start = std::chrono::steady_clock::now();
+            std::int64_t sum = ParallelReduce(pool, cont, std::int64_t(0), std::plus<>());
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if(threads == 1) {
+                expected = sum;
+            }
+            std::cout << " " << elements << " ints, " << threads << " threads: " << elapsed.count() << " ms"
+                      << (sum == expected ? "" : " (MISMATCH)") << std::endl;
+        }
+    }
+}
+// Builds random trees of 10^3 to 10^7 nodes both as a FlatTree and as
+// individually allocated nodes with child pointers, and compares nodes per
+// second of a pre-order sum. Cache misses are left to an external profiler,
+// e.g. perf stat -e cache-misses.
+struct PointerNode {
+    int value;
+    std::vector<PointerNode*> children;
+};
+static std::int64_t SumRecursive(const PointerNode* node) {
+    std::int64_t total = node->value;
+    for(const PointerNode* child : node->children) {
+        total += SumRecursive(child);
+    }
+    return total;
+}
+void BenchmarkTree() {
+    std::cout << "Benchmark: FlatTree vs pointer tree, pre-order" << std::endl;
+    for(std::size_t nodes : {1000, 10000, 100000, 1000000, 10000000}) {
+        std::mt19937 rng(3);
+        FlatTree<int>::Builder builder;
+        std::vector<std::unique_ptr<PointerNode>> pointer_nodes;
+        builder.AddRoot(0);
+        pointer_nodes.push_back(std::make_unique<PointerNode>(PointerNode{0, {}}));
+        for(std::size_t i = 1; i < nodes; i++) {
+            std::uint32_t parent = std::uniform_int_distribution<std::uint32_t>(0, i - 1)(rng);
+            builder.AddChild(parent, int(i & 0xff));
+            pointer_nodes.push_back(std::make_unique<PointerNode>(PointerNode{int(i & 0xff), {}}));
+            pointer_nodes[parent]->children.push_back(pointer_nodes.back().get());
+        }
+        FlatTree<int> tree = builder.Build();
+        auto measure = [nodes](auto&& sum) {
+            auto start = std::chrono::steady_clock::now();
+            std::int64_t total = sum();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return std::make_pair(nodes / elapsed.count() / 1e6, total);
+        };
+        auto flat = measure([&] {
+            std::int64_t total = 0;
+            for(int i : tree.PreOrder()) {
+                total += i;
+            }
+            return total;
+        });
+        auto pointer = measure([&] { return SumRecursive(pointer_nodes.front().get()); });
+        std::cout << " " << nodes << " nodes: FlatTree " << flat.first << " M nodes/s, pointer tree "
+                  << pointer.first << " M nodes/s" << (flat.second == pointer.second ? "" : " (MISMATCH)") << std::endl;
+    }
 }
 int main() {
     ClientCode();
-    return 0;
+    std::cout << std::endl;
+    bool passed = StressPool();
+    BenchmarkSum();
+    std::cout << "Benchmark: AoS vs SoA over " << (1 << 20) << " records" << std::endl;
+    BenchmarkLayout<1>();
+    BenchmarkLayout<3>();
+    BenchmarkLayout<15>();
+    BenchmarkLayout<63>();
+    BenchmarkParallelReduce();
+    BenchmarkTree();
+    return passed ? 0 : 1;
 }
@@ -6,42 +6,88 @@
     which you want to make independent. The separate components only depend
     on a single mediator the redirects the calls. Example : Aircraft landing
 */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class BaseComponent;
 class Mediator {
 public:
+    virtual ~Mediator() {}
     virtual void Notify(BaseComponent* sender, std::string event) const = 0;
 };
 class BaseComponent {
 protected:
     Mediator* mediator_;
+    std::string* trace_ = nullptr;
+    // Components report what they do through Trace. With a trace set, the
+    // operation is appended to it instead of being printed.
+    void Trace(const char* message, char operation) {
+        if(this->trace_) {
+            this->trace_->push_back(operation);
+        } else {
+            std::cout << message;
+        }
+    }
 public:
     BaseComponent(Mediator* mediator = nullptr) : mediator_(mediator) {}
+    virtual ~BaseComponent() {}
     void set_mediator(Mediator* mediator) {
         this->mediator_ = mediator;
     }
+    void set_trace(std::string* trace) {
+        this->trace_ = trace;
+    }
+    static constexpr std::size_t kNoKind = SIZE_MAX;
+    // Small dense number identifying the component class, used to index
+    // dispatch tables. Components which don't override it have kNoKind and
+    // get no reactions from table dispatch.
+    virtual std::size_t kind() const {
+        return kNoKind;
+    }
 };
 class Component1 : public BaseComponent {
 public:
+    static constexpr std::size_t kKind = 0;
+    std::size_t kind() const override {
+        return kKind;
+    }
     void DoA() {
-        std::cout << "Component 1 does A.\n";
+        this->Trace("Component 1 does A.\n", 'A');
         this->mediator_->Notify(this, "A");
     }
     void DoB() {
-        std::cout << "Component 1 does B.\n";
+        this->Trace("Component 1 does B.\n", 'B');
         this->mediator_->Notify(this, "B");
     }
 };
 class Component2 : public BaseComponent {
 public:
+    static constexpr std::size_t kKind = 1;
+    std::size_t kind() const override {
+        return kKind;
+    }
     void DoC() {
-        std::cout << "Component 2 does C.\n";
+        this->Trace("Component 2 does C.\n", 'C');
         this->mediator_->Notify(this, "C");
     }
     void DoD() {
-        std::cout << "Component 2 does D.\n";
+        this->Trace("Component 2 does D.\n", 'D');
         this->mediator_->Notify(this, "D");
     }
 };
@@ -66,6 +112,92 @@ public:
         }
     }
 };
+typedef std::uint32_t EventId;
+// Interns event names into dense integer ids.
+class EventRegistry {
+private:
+    struct NameHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view name) const {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+    std::unordered_map<std::string, EventId, NameHash, std::equal_to<>> ids_;
+    std::vector<std::string> names_;
+public:
+    EventId Intern(std::string_view name) {
+        auto it = this->ids_.find(name);
+        if(it != this->ids_.end()) {
+            return it->second;
+        }
+        EventId id = this->names_.size();
+        this->names_.emplace_back(name);
+        this->ids_.emplace(this->names_.back(), id);
+        return id;
+    }
+    bool Find(std::string_view name, EventId& id) const {
+        auto it = this->ids_.find(name);
+        if(it == this->ids_.end()) {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+    const std::string& Name(EventId id) const {
+        return this->names_[id];
+    }
+    std::size_t size() const {
+        return this->names_.size();
+    }
+};
+// Mediator whose reactions are registered per (component kind, event) and
+// dispatched through a flat table indexed by event id and kind, instead of a
+// chain of string compares. Events are interned when reactions are
+// registered; Notify with an EventId is a single table lookup. The string
+// Notify stays available for components that raise events by name.
+class TableMediator : public Mediator {
+public:
+    typedef std::function<void(BaseComponent* sender)> Reaction;
+private:
+    std::size_t kinds_;
+    EventRegistry events_;
+    std::vector<Reaction> table_;
+public:
+    explicit TableMediator(std::size_t kinds) : kinds_(kinds) {}
+    EventId Intern(std::string_view event) {
+        EventId id = this->events_.Intern(event);
+        this->table_.resize(this->events_.size() * this->kinds_);
+        return id;
+    }
+    // Registers the reaction to components of the given kind raising event,
+    // replacing any earlier one. Throws std::out_of_range if kind isn't below
+    // the number of kinds the mediator was made for.
+    EventId On(std::size_t kind, std::string_view event, Reaction reaction) {
+        if(kind >= this->kinds_) {
+            throw std::out_of_range("TableMediator::On: kind " + std::to_string(kind) + " out of range");
+        }
+        EventId id = this->Intern(event);
+        this->table_[id * this->kinds_ + kind] = std::move(reaction);
+        return id;
+    }
+    // Events which weren't interned and senders whose kind is out of range
+    // have no reaction, like unknown names in the string Notify.
+    void Notify(BaseComponent* sender, EventId event) const {
+        if(event >= this->events_.size() || sender->kind() >= this->kinds_) {
+            return;
+        }
+        const Reaction& reaction = this->table_[event * this->kinds_ + sender->kind()];
+        if(reaction) {
+            reaction(sender);
+        }
+    }
+    void Notify(BaseComponent* sender, std::string event) const override {
+        EventId id;
+        if(this->events_.Find(event, id)) {
+            this->Notify(sender, id);
+        }
+    }
+};
 void ClientCode() {
     Component1* c1 = new Component1();
     Component2* c2 = new Component2();
@@ -76,11 +208,359 @@ void ClientCode() {
     std::cout << "Client triggers operation D.\n";
     c2->DoD();
 
+    delete mediator;
+
+    std::cout << "\n";
+    std::cout << "Client sets up a TableMediator with the same reactions.\n";
+    TableMediator table(2);
+    c1->set_mediator(&table);
+    c2->set_mediator(&table);
+    table.On(Component1::kKind, "A", [&](BaseComponent*) {
+        std::cout << "Mediator reacts on A and triggers following operations:\n";
+        c2->DoC();
+    });
+    table.On(Component2::kKind, "D", [&](BaseComponent*) {
+        std::cout << "Mediator reacts on D and triggers following operations:\n";
+        c1->DoB();
+        c2->DoC();
+    });
+    std::cout << "Client triggers operation A.\n";
+    c1->DoA();
+    std::cout << "\n";
+    std::cout << "Client triggers operation D.\n";
+    c2->DoD();
+    std::cout << "\n";
+    std::cout << "Client notifies an unknown event id and a component without a kind.\n";
+    BaseComponent plain(&table);
+    table.Notify(c1, EventId(42));
+    table.Notify(&plain, "A");
+    try {
+        table.On(2, "A", [](BaseComponent*) {});
+    } catch(const std::out_of_range& e) {
+        std::cout << "Rejected: " << e.what() << "\n";
+    }
+
     delete c1;
     delete c2;
-    delete mediator;
+}
+// Runs tasks on a fixed set of shards, each drained in order by its own worker
+// thread. Other threads post through a lock-free multi-producer queue per
+// shard. Tasks posted by a shard's own worker while it runs a task are run
+// right after that task, before anything else queued on the shard, so the
+// order of events matches depth-first synchronous dispatch as long as
+// reactions don't depend on a nested reaction having already run.
+class ShardedEventBus {
+public:
+    typedef std::function<void()> Task;
+private:
+    struct Node {
+        Task task;
+        Node* next;
+    };
+    struct Shard {
+        std::atomic<Node*> head{nullptr};
+        std::atomic<bool> sleeping{false};
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::vector<Task> children;
+    };
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> pending_{0};
+    std::mutex drain_mutex_;
+    std::condition_variable drained_;
+    std::atomic<bool> stop_{false};
+    static thread_local Shard* current_shard_;
+
+    void Run(Shard& shard) {
+        current_shard_ = &shard;
+        std::deque<Task> local;
+        while(true) {
+            if(local.empty()) {
+                Node* batch = shard.head.exchange(nullptr);
+                if(!batch) {
+                    if(this->stop_) {
+                        return;
+                    }
+                    std::unique_lock<std::mutex> lock(shard.mutex);
+                    shard.sleeping = true;
+                    shard.wake.wait(lock, [&] { return shard.head.load() != nullptr || this->stop_; });
+                    shard.sleeping = false;
+                    continue;
+                }
+                // The queue is a stack, pushing to the front restores FIFO.
+                while(batch) {
+                    local.push_front(std::move(batch->task));
+                    delete std::exchange(batch, batch->next);
+                }
+            }
+            Task task = std::move(local.front());
+            local.pop_front();
+            task();
+            for(auto it = shard.children.rbegin(); it != shard.children.rend(); ++it) {
+                local.push_front(std::move(*it));
+            }
+            shard.children.clear();
+            if(--this->pending_ == 0) {
+                std::lock_guard<std::mutex> lock(this->drain_mutex_);
+                this->drained_.notify_all();
+            }
+        }
+    }
+public:
+    explicit ShardedEventBus(std::size_t shards) {
+        for(std::size_t i = 0; i < std::max<std::size_t>(shards, 1); i++) {
+            this->shards_.push_back(std::make_unique<Shard>());
+        }
+        for(auto& shard : this->shards_) {
+            this->workers_.emplace_back(&ShardedEventBus::Run, this, std::ref(*shard));
+        }
+    }
+    // Call Drain first, tasks still queued once the workers have stopped are
+    // dropped without running.
+    ~ShardedEventBus() {
+        this->stop_ = true;
+        for(auto& shard : this->shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->wake.notify_one();
+        }
+        for(std::thread& worker : this->workers_) {
+            worker.join();
+        }
+        for(auto& shard : this->shards_) {
+            for(Node* node = shard->head.exchange(nullptr); node; ) {
+                delete std::exchange(node, node->next);
+            }
+        }
+    }
+    std::size_t size() const {
+        return this->shards_.size();
+    }
+    void Post(std::size_t index, Task task) {
+        Shard& shard = *this->shards_[index % this->shards_.size()];
+        this->pending_++;
+        if(current_shard_ == &shard) {
+            shard.children.push_back(std::move(task));
+            return;
+        }
+        Node* node = new Node{std::move(task), shard.head.load()};
+        while(!shard.head.compare_exchange_weak(node->next, node)) {
+        }
+        if(shard.sleeping) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.wake.notify_one();
+        }
+    }
+    // Blocks until every posted task, and everything they posted, has run.
+    void Drain() {
+        std::unique_lock<std::mutex> lock(this->drain_mutex_);
+        this->drained_.wait(lock, [&] { return this->pending_ == 0; });
+    }
+};
+thread_local ShardedEventBus::Shard* ShardedEventBus::current_shard_ = nullptr;
+// Mediator which doesn't react on the caller's stack. Notify queues the
+// reaction of the wrapped mediator onto this mediator's shard, so components
+// sharing a mediator see their events in order while independent mediators
+// spread over the shards. An operation called directly still has its
+// reaction queued, but runs on the caller's thread, where it races with
+// reactions already running on the shard; post operations with Post unless
+// the shard is known to be idle.
+class AsyncMediator : public Mediator {
+private:
+    const Mediator* reactions_;
+    ShardedEventBus* bus_;
+    std::size_t shard_;
+public:
+    AsyncMediator(const Mediator* reactions, ShardedEventBus& bus, std::size_t shard) :
+        reactions_(reactions), bus_(&bus), shard_(shard) {}
+    void Notify(BaseComponent* sender, std::string event) const override {
+        this->bus_->Post(this->shard_, [reactions = this->reactions_, sender, event = std::move(event)] {
+            reactions->Notify(sender, event);
+        });
+    }
+    void Post(ShardedEventBus::Task operation) const {
+        this->bus_->Post(this->shard_, std::move(operation));
+    }
+};
+// A component raising synthetic events, for the benchmark.
+class Sensor : public BaseComponent {
+public:
+    std::size_t kind() const override {
+        return 0;
+    }
+};
+// Mediator reacting like ConcreteMediator, by comparing the event against
+// every known name in turn.
+class ChainMediator : public Mediator {
+private:
+    std::vector<std::pair<std::string, std::function<void(BaseComponent*)>>> reactions_;
+public:
+    void On(std::string event, std::function<void(BaseComponent*)> reaction) {
+        this->reactions_.emplace_back(std::move(event), std::move(reaction));
+    }
+    void Notify(BaseComponent* sender, std::string event) const override {
+        for(const auto& [name, reaction] : this->reactions_) {
+            if(event == name) {
+                reaction(sender);
+            }
+        }
+    }
+};
+// Notify throughput of the compare chain, of TableMediator by name and of
+// TableMediator by id, as the number of registered events grows. Returns
+// false if any of them ran the wrong number of reactions.
+bool BenchmarkNotify() {
+    bool passed = true;
+    const std::size_t kNotifies = 100000;
+    std::cout << "Benchmark: notifies per second\n";
+    for(std::size_t events : {2, 10, 100, 1000, 10000}) {
+        std::size_t reactions = 0;
+        ChainMediator chain;
+        TableMediator table(1);
+        std::vector<std::string> names;
+        std::vector<EventId> ids;
+        for(std::size_t i = 0; i < events; i++) {
+            names.push_back("Event" + std::to_string(i));
+            chain.On(names.back(), [&](BaseComponent*) { reactions++; });
+            ids.push_back(table.On(0, names.back(), [&](BaseComponent*) { reactions++; }));
+        }
+        std::mt19937 rng(5);
+        std::vector<std::size_t> picks(kNotifies);
+        for(std::size_t& pick : picks) {
+            pick = std::uniform_int_distribution<std::size_t>(0, events - 1)(rng);
+        }
+        Sensor sensor;
+        auto measure = [&](auto&& notify) {
+            reactions = 0;
+            auto start = std::chrono::steady_clock::now();
+            for(std::size_t pick : picks) {
+                notify(pick);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if(reactions != kNotifies) {
+                std::cout << " mismatch: " << reactions << " reactions for " << kNotifies << " notifies\n";
+                passed = false;
+            }
+            return kNotifies / elapsed.count() / 1e6;
+        };
+        double chained = measure([&](std::size_t pick) { chain.Notify(&sensor, names[pick]); });
+        double by_name = measure([&](std::size_t pick) { table.Notify(&sensor, names[pick]); });
+        double by_id = measure([&](std::size_t pick) { table.Notify(&sensor, ids[pick]); });
+        std::cout << " " << events << " events: compare chain " << chained << " M/s, table by name "
+                  << by_name << " M/s, table by id " << by_id << " M/s\n";
+    }
+    return passed;
+}
+// Independent pairs of components with the reactions of ConcreteMediator,
+// driven by the same random operations once synchronously and once through
+// AsyncMediators on a ShardedEventBus. Checks that every component traced the
+// same operations in the same order, and reports events per second.
+void StressAsyncMediator(std::size_t shards) {
+    const std::size_t kGroups = 64;
+    const std::size_t kOperations = 5000;
+    struct Group {
+        Component1 c1;
+        Component2 c2;
+        TableMediator reactions{2};
+        std::string trace1;
+        std::string trace2;
+        std::vector<int> operations;
+    };
+    std::vector<std::unique_ptr<Group>> groups;
+    std::mt19937 rng(11);
+    for(std::size_t g = 0; g < kGroups; g++) {
+        auto group = std::make_unique<Group>();
+        Group* p = group.get();
+        p->reactions.On(Component1::kKind, "A", [p](BaseComponent*) { p->c2.DoC(); });
+        p->reactions.On(Component2::kKind, "D", [p](BaseComponent*) {
+            p->c1.DoB();
+            p->c2.DoC();
+        });
+        p->c1.set_trace(&p->trace1);
+        p->c2.set_trace(&p->trace2);
+        for(std::size_t i = 0; i < kOperations; i++) {
+            p->operations.push_back(std::uniform_int_distribution<int>(0, 3)(rng));
+        }
+        groups.push_back(std::move(group));
+    }
+    auto apply = [](Group& group, int operation) {
+        switch(operation) {
+        case 0: group.c1.DoA(); break;
+        case 1: group.c1.DoB(); break;
+        case 2: group.c2.DoC(); break;
+        default: group.c2.DoD(); break;
+        }
+    };
+    std::vector<std::pair<std::string, std::string>> expected;
+    for(auto& group : groups) {
+        group->c1.set_mediator(&group->reactions);
+        group->c2.set_mediator(&group->reactions);
+        for(int operation : group->operations) {
+            apply(*group, operation);
+        }
+        expected.emplace_back(std::move(group->trace1), std::move(group->trace2));
+        group->trace1.clear();
+        group->trace2.clear();
+    }
+
+    std::size_t mismatches = 0;
+    std::size_t events = 0;
+    std::chrono::duration<double> elapsed;
+    {
+        ShardedEventBus bus(shards);
+        std::vector<std::unique_ptr<AsyncMediator>> mediators;
+        for(std::size_t g = 0; g < kGroups; g++) {
+            mediators.push_back(std::make_unique<AsyncMediator>(&groups[g]->reactions, bus, g));
+            groups[g]->c1.set_mediator(mediators.back().get());
+            groups[g]->c2.set_mediator(mediators.back().get());
+        }
+        auto start = std::chrono::steady_clock::now();
+        for(std::size_t i = 0; i < kOperations; i++) {
+            for(std::size_t g = 0; g < kGroups; g++) {
+                Group* group = groups[g].get();
+                int operation = group->operations[i];
+                mediators[g]->Post([group, operation, &apply] { apply(*group, operation); });
+            }
+        }
+        bus.Drain();
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    for(std::size_t g = 0; g < kGroups; g++) {
+        mismatches += groups[g]->trace1 != expected[g].first || groups[g]->trace2 != expected[g].second;
+        events += groups[g]->trace1.size() + groups[g]->trace2.size();
+    }
+    std::cout << " " << shards << " shards: " << events / elapsed.count() / 1e6 << " M events/s, "
+              << mismatches << " of " << kGroups << " groups differ from the synchronous mediator\n";
+}
+// An operation called directly on an idle shard, instead of through
+// AsyncMediator::Post, still gets its reaction queued and run on the shard.
+bool CheckDirectCall() {
+    Component1 c1;
+    Component2 c2;
+    std::string trace;
+    TableMediator reactions(2);
+    reactions.On(Component1::kKind, "A", [&](BaseComponent*) { c2.DoC(); });
+    ShardedEventBus bus(1);
+    AsyncMediator mediator(&reactions, bus, 0);
+    c1.set_trace(&trace);
+    c2.set_trace(&trace);
+    c1.set_mediator(&mediator);
+    c2.set_mediator(&mediator);
+    c1.DoA();
+    bus.Drain();
+    std::cout << "Direct call traced " << trace << ", expected AC\n";
+    return trace == "AC";
 }
 int main() {
     ClientCode();
-    return 0;
+    std::cout << "\n";
+    bool passed = CheckDirectCall();
+    std::cout << "\n";
+    passed = BenchmarkNotify() && passed;
+    std::cout << "\n";
+    std::cout << "Benchmark: AsyncMediator events per second\n";
+    for(std::size_t shards : {1, 2, 4, 8}) {
+        StressAsyncMediator(shards);
+    }
+    return passed ? 0 : 1;
 }
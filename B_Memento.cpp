@@ -6,9 +6,30 @@
     aren't acessible to any other object except the one who produced it. Caretakers are the 
     objects that store mementos, works with it only via limited interface.
 */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
 #include <vector>
-#include <time.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "AllocationCounter.h"
 
 class Memento {
 public:
@@ -17,28 +38,260 @@ public:
     virtual std::string date() const = 0;
     virtual std::string state() const = 0;
 };
-class ConcreteMemento : public Memento {
+// Byte string split into fixed-size chunks shared by reference count, so a
+// copy is O(1) and shares every chunk. A write copies the chunk table and the
+// chunks it touches only while they are shared; unchanged chunks stay shared
+// between all the copies. Not thread safe, a copy is only as safe to hand to
+// another thread as the chunks it shares.
+class ChunkedState {
+public:
+    static constexpr std::size_t kChunkSize = 16 << 10;
+    ChunkedState() : table_(std::make_shared<Table>()) {}
+    explicit ChunkedState(std::string_view bytes) : ChunkedState() {
+        this->Write(0, bytes);
+    }
+    std::size_t size() const {
+        return this->size_;
+    }
+    std::size_t chunk_count() const {
+        return this->table_->size();
+    }
+    const std::string& chunk(std::size_t i) const {
+        return *(*this->table_)[i];
+    }
+    // True when chunk i is the same object in both states, so it is equal
+    // without looking at the bytes.
+    bool SharesChunk(const ChunkedState& other, std::size_t i) const {
+        return (*this->table_)[i] == (*other.table_)[i];
+    }
+    // Bytes this state holds apart from what it shares with base: its chunk
+    // table and the chunks it doesn't share.
+    std::size_t UnsharedBytes(const ChunkedState& base) const {
+        std::size_t bytes = this->chunk_count() * sizeof(Table::value_type);
+        for(std::size_t i = 0; i < this->chunk_count(); i++) {
+            if(i >= base.chunk_count() || !this->SharesChunk(base, i)) {
+                bytes += this->chunk(i).size();
+            }
+        }
+        return bytes;
+    }
+    std::string str() const {
+        std::string bytes;
+        bytes.reserve(this->size_);
+        for(const auto& chunk : *this->table_) {
+            bytes += *chunk;
+        }
+        return bytes;
+    }
+    std::string substr(std::size_t pos, std::size_t n) const {
+        std::string bytes;
+        for(std::size_t i = pos / kChunkSize; i < this->chunk_count() && bytes.size() < n; i++) {
+            std::size_t from = i == pos / kChunkSize ? pos % kChunkSize : 0;
+            bytes.append(this->chunk(i), from, n - bytes.size());
+        }
+        return bytes;
+    }
+    // Overwrites part of the state, growing it with zero bytes if needed.
+    void Write(std::size_t offset, std::string_view bytes) {
+        Table& table = this->MutableTable();
+        std::size_t end = offset + bytes.size();
+        if(end > this->size_) {
+            if(!table.empty()) {
+                std::string& last = this->MutableChunk(table, table.size() - 1);
+                last.resize(std::min(kChunkSize, end - (table.size() - 1) * kChunkSize));
+            }
+            while(table.size() * kChunkSize < end) {
+                table.push_back(std::make_shared<std::string>(std::min(kChunkSize, end - table.size() * kChunkSize), '\0'));
+            }
+            this->size_ = end;
+        }
+        while(offset < end) {
+            std::size_t from = offset % kChunkSize;
+            std::size_t n = std::min(kChunkSize - from, end - offset);
+            std::string& chunk = this->MutableChunk(table, offset / kChunkSize);
+            std::memcpy(&chunk[from], bytes.data() + (bytes.size() - (end - offset)), n);
+            offset += n;
+        }
+    }
+    friend std::ostream& operator<<(std::ostream& os, const ChunkedState& state) {
+        for(const auto& chunk : *state.table_) {
+            os << *chunk;
+        }
+        return os;
+    }
 private:
-    std::string state_;
-    std::string date_;
+    typedef std::vector<std::shared_ptr<std::string>> Table;
+    std::shared_ptr<Table> table_;
+    std::size_t size_ = 0;
+    Table& MutableTable() {
+        if(this->table_.use_count() > 1) {
+            this->table_ = std::make_shared<Table>(*this->table_);
+        }
+        return *this->table_;
+    }
+    std::string& MutableChunk(Table& table, std::size_t i) {
+        if(table[i].use_count() > 1) {
+            table[i] = std::make_shared<std::string>(*table[i]);
+        }
+        return *table[i];
+    }
+};
+// When a memento was taken: raw steady clock ticks and a sequence number.
+// Taking one reads the clock and bumps a counter; the date is only
+// formatted when asked for.
+struct Stamp {
+    std::int64_t ticks;
+    std::uint64_t id;
+    static Stamp Now() {
+        static std::atomic<std::uint64_t> next_id{0};
+        return {std::chrono::steady_clock::now().time_since_epoch().count(),
+                next_id.fetch_add(1, std::memory_order_relaxed)};
+    }
+    // The wall clock date of the ticks, in ctime() format.
+    std::string Date() const {
+        auto age = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(this->ticks);
+        std::time_t time = std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(age));
+        return std::ctime(&time);
+    }
+};
+// Date and name handling shared by the concrete mementos. The name shows the
+// first characters of the state, kept aside so that it doesn't need the state.
+// Both are formatted on demand from the stamp.
+class TimestampedMemento : public Memento {
+private:
+    Stamp stamp_;
+    std::string preview_;
 public:
-    ConcreteMemento(std::string state) : state_(state) {
-        std::time_t now = std::time(0);
-        this->date_ = std::ctime(&now);
+    TimestampedMemento(std::string preview, Stamp stamp = Stamp::Now()) :
+        stamp_(stamp), preview_(std::move(preview)) {}
+    static std::string Name(const std::string& date, std::string_view preview) {
+        return date + " / (" + std::string(preview) + "...)";
     }
-    std::string state() const override {
-        return this->state_;
+    Stamp stamp() const {
+        return this->stamp_;
+    }
+    const std::string& preview() const {
+        return this->preview_;
     }
     std::string date() const override {
-        return this->date_;
+        return this->stamp_.Date();
     }
     std::string GetName() const override {
-        return this->date_ + " / (" + this->state_.substr(0, 9) + "...)";
+        return Name(this->date(), this->preview_);
+    }
+};
+// Holds a copy-on-write snapshot of the state: saving shares the chunks of
+// the originator, and only the chunks written after the save get copied.
+class ConcreteMemento : public TimestampedMemento {
+private:
+    ChunkedState state_;
+public:
+    ConcreteMemento(ChunkedState state, Stamp stamp = Stamp::Now()) :
+        TimestampedMemento(state.substr(0, 9), stamp), state_(std::move(state)) {}
+    std::string state() const override {
+        return this->state_.str();
+    }
+    const ChunkedState& snapshot() const {
+        return this->state_;
+    }
+};
+// One link of a delta history. A keyframe holds the whole state in a single
+// run and has no base; every other node holds the runs of bytes that changed
+// since its base, the previous snapshot.
+struct DeltaNode {
+    std::shared_ptr<const DeltaNode> base;
+    std::size_t size;
+    std::vector<std::pair<std::size_t, std::string>> runs;
+    std::size_t StoredBytes() const {
+        std::size_t bytes = 0;
+        for(const auto& run : this->runs) {
+            bytes += run.second.size();
+        }
+        return bytes;
+    }
+};
+// Memento storing only a delta to the previous snapshot. The state is rebuilt
+// from the last keyframe by applying the deltas after it in order. Nodes are
+// shared, so a memento stays valid when older mementos are deleted.
+class DeltaMemento : public TimestampedMemento {
+private:
+    std::shared_ptr<const DeltaNode> node_;
+public:
+    DeltaMemento(std::string preview, std::shared_ptr<const DeltaNode> node) :
+        TimestampedMemento(std::move(preview)), node_(std::move(node)) {}
+    std::string state() const override {
+        std::vector<const DeltaNode*> chain;
+        for(const DeltaNode* node = this->node_.get(); node; node = node->base.get()) {
+            chain.push_back(node);
+        }
+        std::string state;
+        for(auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            state.resize((*it)->size);
+            for(const auto& run : (*it)->runs) {
+                state.replace(run.first, run.second.size(), run.second);
+            }
+        }
+        return state;
+    }
+    std::size_t stored_bytes() const {
+        return this->node_->StoredBytes();
     }
 };
 class Originator {
 private:
-    std::string state_;
+    ChunkedState state_;
+    bool verbose_;
+    // Delta mode: a keyframe every keyframe_interval_ snapshots, 0 for
+    // copy-on-write snapshots.
+    std::size_t keyframe_interval_ = 0;
+    std::size_t since_keyframe_ = 0;
+    std::shared_ptr<const DeltaNode> last_node_;
+    ChunkedState last_saved_;
+    // Runs of bytes where state differs from base, offset by start. Runs
+    // closer than a few bytes are merged, a run costs more than the bytes in
+    // between.
+    static void Diff(const std::string& base, const std::string& state, std::size_t start,
+                     std::vector<std::pair<std::size_t, std::string>>& runs) {
+        const std::size_t kMergeGap = 16;
+        const std::size_t kBlock = 256;
+        std::size_t common = std::min(base.size(), state.size());
+        std::size_t i = 0;
+        while(i < common) {
+            if(i % kBlock == 0 && i + kBlock <= common && std::memcmp(&base[i], &state[i], kBlock) == 0) {
+                i += kBlock;
+                continue;
+            }
+            if(base[i] == state[i]) {
+                i++;
+                continue;
+            }
+            std::size_t end = i + 1;
+            std::size_t same = 0;
+            while(end < common && same < kMergeGap) {
+                same = base[end] == state[end] ? same + 1 : 0;
+                end++;
+            }
+            end -= same;
+            runs.emplace_back(start + i, state.substr(i, end - i));
+            i = end;
+        }
+        if(state.size() > common) {
+            runs.emplace_back(start + common, state.substr(common));
+        }
+    }
+    // Chunks still shared with base are equal and skipped without reading them.
+    static std::vector<std::pair<std::size_t, std::string>> Diff(const ChunkedState& base, const ChunkedState& state) {
+        std::vector<std::pair<std::size_t, std::string>> runs;
+        for(std::size_t i = 0; i < state.chunk_count(); i++) {
+            if(i >= base.chunk_count()) {
+                runs.emplace_back(i * ChunkedState::kChunkSize, state.chunk(i));
+            } else if(!state.SharesChunk(base, i)) {
+                Diff(base.chunk(i), state.chunk(i), i * ChunkedState::kChunkSize, runs);
+            }
+        }
+        return runs;
+    }
     std::string GenerateRandomString(int length = 10) {
         const char alphanum[] = 
             "012345678"
@@ -52,52 +305,408 @@ private:
         return random_string;
     }
 public:
-    Originator(std::string state) : state_(state) {
-        std::cout << "Originator: My initial state is: " << this->state_ << "\n"; 
+    Originator(std::string state, bool verbose = true) : state_(state), verbose_(verbose) {
+        if(this->verbose_) {
+            std::cout << "Originator: My initial state is: " << this->state_ << "\n";
+        }
+    }
+    // Switches Save to delta mementos with a keyframe every interval snapshots,
+    // or back to copy-on-write snapshots with 0.
+    void set_keyframe_interval(std::size_t interval) {
+        this->keyframe_interval_ = interval;
+        this->since_keyframe_ = 0;
+        this->last_node_.reset();
+        this->last_saved_ = ChunkedState();
+    }
+    // Overwrites part of the state, growing it if needed.
+    void Write(std::size_t offset, std::string_view bytes) {
+        this->state_.Write(offset, bytes);
+    }
+    const ChunkedState& state() const {
+        return this->state_;
     }
     void DoSomething() {
         std::cout << "Originator: I'm doing something important.\n";
-        this->state_ = this->GenerateRandomString(30);
+        this->state_ = ChunkedState(this->GenerateRandomString(30));
         std::cout << "Originator: and my state has changed to: " << this->state_ << "\n";
     }
     Memento* Save() {
-        return new ConcreteMemento(this->state_);
+        if(this->keyframe_interval_ == 0) {
+            return new ConcreteMemento(this->state_);
+        }
+        auto node = std::make_shared<DeltaNode>();
+        node->size = this->state_.size();
+        if(!this->last_node_ || this->since_keyframe_ + 1 >= this->keyframe_interval_) {
+            node->runs.emplace_back(0, this->state_.str());
+            this->since_keyframe_ = 0;
+        } else {
+            node->base = this->last_node_;
+            node->runs = Diff(this->last_saved_, this->state_);
+            this->since_keyframe_++;
+        }
+        this->last_node_ = node;
+        this->last_saved_ = this->state_;
+        return new DeltaMemento(this->state_.substr(0, 9), std::move(node));
     }
+    // Restoring a snapshot of this originator only swaps the chunk table in.
     void Restore(Memento* memento) {
-        this->state_ = memento->state();
-        std::cout << "Originator: My state has changed to: " << this->state_ << "\n";
+        if(ConcreteMemento* snapshot = dynamic_cast<ConcreteMemento*>(memento)) {
+            this->state_ = snapshot->snapshot();
+        } else {
+            this->state_ = ChunkedState(memento->state());
+        }
+        if(this->verbose_) {
+            std::cout << "Originator: My state has changed to: " << this->state_ << "\n";
+        }
     }
 };
+// Byte-oriented LZ77 compressor writing the LZ4 block format: each sequence
+// is a token with the literal and match lengths, the literals, and a 2-byte
+// offset back to the match. The last sequence has literals only. As LZ4
+// requires at the end of a block, no match starts in the last 12 bytes and
+// the last 5 bytes are always literals, so any LZ4 decoder accepts the output.
+class BlockCompressor {
+private:
+    static constexpr std::size_t kMinMatch = 4;
+    static constexpr std::size_t kMatchStartLimit = 12;
+    static constexpr std::size_t kLastLiterals = 5;
+    static constexpr int kHashBits = 12;
+    static void PutLength(std::string& out, std::size_t length) {
+        for(; length >= 255; length -= 255) {
+            out += char(255);
+        }
+        out += char(length);
+    }
+    static void Expect(bool ok) {
+        if(!ok) {
+            throw std::runtime_error("BlockCompressor: corrupt block");
+        }
+    }
+    static std::size_t GetLength(const unsigned char*& in, const unsigned char* end, std::size_t length) {
+        if(length == 15) {
+            unsigned char byte;
+            do {
+                Expect(in < end);
+                byte = *in++;
+                length += byte;
+            } while(byte == 255);
+        }
+        return length;
+    }
+    static void PutSequence(std::string& out, std::string_view literals, std::size_t offset, std::size_t match) {
+        std::size_t match_code = match ? match - kMinMatch : 0;
+        out += char(std::min<std::size_t>(literals.size(), 15) << 4 | std::min<std::size_t>(match_code, 15));
+        if(literals.size() >= 15) {
+            PutLength(out, literals.size() - 15);
+        }
+        out += literals;
+        if(match) {
+            out += char(offset & 0xff);
+            out += char(offset >> 8);
+            if(match_code >= 15) {
+                PutLength(out, match_code - 15);
+            }
+        }
+    }
+public:
+    static std::string Compress(std::string_view in) {
+        std::vector<std::uint32_t> table(std::size_t(1) << kHashBits, 0);
+        std::string out;
+        out.reserve(in.size() / 2 + 16);
+        std::size_t anchor = 0;
+        std::size_t i = 0;
+        std::size_t match_end = in.size() > kLastLiterals ? in.size() - kLastLiterals : 0;
+        while(i + kMatchStartLimit <= in.size()) {
+            std::uint32_t sequence;
+            std::memcpy(&sequence, in.data() + i, sizeof(sequence));
+            std::uint32_t& slot = table[(sequence * 2654435761u) >> (32 - kHashBits)];
+            std::size_t candidate = slot;
+            slot = i + 1;
+            if(candidate && i + 1 - candidate <= 0xffff && std::memcmp(in.data() + candidate - 1, in.data() + i, kMinMatch) == 0) {
+                std::size_t from = candidate - 1;
+                std::size_t match = kMinMatch;
+                while(i + match < match_end && in[from + match] == in[i + match]) {
+                    match++;
+                }
+                PutSequence(out, in.substr(anchor, i - anchor), i - from, match);
+                i += match;
+                anchor = i;
+            } else {
+                // Step faster through data that doesn't match.
+                i += 1 + ((i - anchor) >> 6);
+            }
+        }
+        PutSequence(out, in.substr(anchor), 0, 0);
+        return out;
+    }
+    // Throws std::runtime_error when the block is truncated, refers before
+    // the start of the output or doesn't decode to exactly size bytes, as a
+    // damaged segment file would.
+    static std::string Decompress(std::string_view in, std::size_t size) {
+        std::string out(size, '\0');
+        const unsigned char* cursor = reinterpret_cast<const unsigned char*>(in.data());
+        const unsigned char* end = cursor + in.size();
+        std::size_t position = 0;
+        while(cursor < end) {
+            unsigned char token = *cursor++;
+            std::size_t literals = GetLength(cursor, end, token >> 4);
+            Expect(literals <= static_cast<std::size_t>(end - cursor) && literals <= size - position);
+            std::memcpy(out.data() + position, cursor, literals);
+            cursor += literals;
+            position += literals;
+            if(cursor >= end) {
+                break;
+            }
+            Expect(end - cursor >= 2);
+            std::size_t offset = cursor[0] | cursor[1] << 8;
+            cursor += 2;
+            std::size_t match = GetLength(cursor, end, token & 15) + kMinMatch;
+            Expect(offset != 0 && offset <= position && match <= size - position);
+            // Byte by byte, a match may overlap the bytes it produces.
+            for(std::size_t k = 0; k < match; k++, position++) {
+                out[position] = out[position - offset];
+            }
+        }
+        Expect(position == size);
+        return out;
+    }
+};
+// Decompresses every truncation of a compressed state and checks that each
+// one is rejected instead of written past the output.
+bool CheckCorruptBlocks() {
+    std::string state;
+    while(state.size() < 4096) {
+        state += "Super-duper-super-puper-super. " + std::to_string(state.size());
+    }
+    std::string block = BlockCompressor::Compress(state);
+    bool intact = BlockCompressor::Decompress(block, state.size()) == state;
+    std::size_t rejected = 0;
+    for(std::size_t length = 0; length < block.size(); length++) {
+        try {
+            BlockCompressor::Decompress(std::string_view(block).substr(0, length), state.size());
+        } catch(const std::runtime_error&) {
+            rejected++;
+        }
+    }
+    std::cout << "BlockCompressor: round trip " << (intact ? "intact" : "broken") << ", rejected " << rejected
+              << " of " << block.size() << " truncated blocks\n";
+    return intact && rejected == block.size();
+}
+// Memory budget of a Caretaker's history. The newest snapshots stay mementos
+// while their states take up to hot_bytes, older ones are kept compressed up
+// to warm_bytes, and the oldest are spilled to the segment file at
+// spill_path, or dropped when there is none. Their metadata goes to an index
+// file next to it, spill_path with ".index" appended.
+struct HistoryPolicy {
+    std::size_t hot_bytes = SIZE_MAX;
+    std::size_t warm_bytes = SIZE_MAX;
+    std::string spill_path;
+};
 class Caretaker {
 private:
-    std::vector<Memento*> mementos_;
+    // Metadata of a snapshot, all that ShowHistory needs.
+    struct SnapshotInfo {
+        Stamp stamp;
+        std::uint64_t size;
+        std::uint64_t stored;
+        char preview[16];
+    };
+    // Entry of the index file, one per spilled snapshot in the order of the
+    // segment file, so that ShowHistory reads the metadata without touching
+    // the payloads.
+    struct ColdEntry {
+        SnapshotInfo info;
+        std::uint64_t offset;
+    };
+    struct HotSnapshot {
+        SnapshotInfo info;
+        Memento* memento;
+    };
+    struct WarmSnapshot {
+        SnapshotInfo info;
+        std::string payload;
+    };
+    // Oldest first: cold in the segment file, then warm, then hot.
+    std::deque<HotSnapshot> hot_;
+    std::deque<WarmSnapshot> warm_;
+    std::size_t hot_bytes_ = 0;
+    std::size_t warm_bytes_ = 0;
+    std::size_t cold_count_ = 0;
+    std::size_t cold_bytes_ = 0;
+    int fd_ = -1;
+    int index_fd_ = -1;
     Originator* originator_;
+    HistoryPolicy policy_;
+    bool verbose_;
+
+    static void Check(bool ok, const char* what) {
+        if(!ok) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+    }
+    static std::string Name(const SnapshotInfo& info) {
+        return TimestampedMemento::Name(info.stamp.Date(), std::string_view(info.preview, std::strlen(info.preview)));
+    }
+    std::string IndexPath() const {
+        return this->policy_.spill_path + ".index";
+    }
+    // Calls visit(entry) for every entry of the index file, mapped read-only
+    // for the call.
+    template<typename Visit>
+    void MapIndex(Visit visit) const {
+        std::size_t length = this->cold_count_ * sizeof(ColdEntry);
+        void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, this->index_fd_, 0);
+        Check(map != MAP_FAILED, "Caretaker: map index");
+        const char* cursor = static_cast<const char*>(map);
+        for(std::size_t i = 0; i < this->cold_count_; i++, cursor += sizeof(ColdEntry)) {
+            ColdEntry entry;
+            std::memcpy(&entry, cursor, sizeof(entry));
+            visit(entry);
+        }
+        munmap(map, length);
+    }
+    void Demote() {
+        HotSnapshot hot = this->hot_.front();
+        this->hot_.pop_front();
+        this->hot_bytes_ -= hot.info.size;
+        std::string payload = BlockCompressor::Compress(hot.memento->state());
+        delete hot.memento;
+        hot.info.stored = payload.size();
+        this->warm_bytes_ += payload.size();
+        this->warm_.push_back({hot.info, std::move(payload)});
+    }
+    void Spill() {
+        WarmSnapshot warm = std::move(this->warm_.front());
+        this->warm_.pop_front();
+        this->warm_bytes_ -= warm.payload.size();
+        if(this->fd_ < 0) {
+            return;
+        }
+        ColdEntry entry{warm.info, this->cold_bytes_};
+        Check(pwrite(this->fd_, warm.payload.data(), warm.payload.size(), this->cold_bytes_) == ssize_t(warm.payload.size()),
+              "Caretaker: spill");
+        Check(pwrite(this->index_fd_, &entry, sizeof(entry), this->cold_count_ * sizeof(entry)) == sizeof(entry),
+              "Caretaker: spill index");
+        this->cold_bytes_ += warm.payload.size();
+        this->cold_count_++;
+    }
+    // Takes the newest snapshot out of the history as a memento, decompressing
+    // or reading it back from the segment file when it isn't hot.
+    Memento* TakeNewest() {
+        if(!this->hot_.empty()) {
+            HotSnapshot hot = this->hot_.back();
+            this->hot_.pop_back();
+            this->hot_bytes_ -= hot.info.size;
+            return hot.memento;
+        }
+        std::string state;
+        Stamp stamp;
+        if(!this->warm_.empty()) {
+            WarmSnapshot& warm = this->warm_.back();
+            state = BlockCompressor::Decompress(warm.payload, warm.info.size);
+            stamp = warm.info.stamp;
+            this->warm_bytes_ -= warm.payload.size();
+            this->warm_.pop_back();
+        } else {
+            ColdEntry entry;
+            std::size_t at = (this->cold_count_ - 1) * sizeof(entry);
+            Check(pread(this->index_fd_, &entry, sizeof(entry), at) == sizeof(entry), "Caretaker: read index");
+            std::string payload(entry.info.stored, '\0');
+            Check(pread(this->fd_, payload.data(), payload.size(), entry.offset) == ssize_t(payload.size()),
+                  "Caretaker: read segment");
+            state = BlockCompressor::Decompress(payload, entry.info.size);
+            stamp = entry.info.stamp;
+            this->cold_bytes_ = entry.offset;
+            this->cold_count_--;
+            Check(ftruncate(this->fd_, this->cold_bytes_) == 0, "Caretaker: truncate segment");
+            Check(ftruncate(this->index_fd_, at) == 0, "Caretaker: truncate index");
+        }
+        return new ConcreteMemento(ChunkedState(state), stamp);
+    }
 public:
-    Caretaker(Originator* originator) : originator_(originator) {}
+    struct Usage {
+        std::size_t hot, warm, cold;
+        std::size_t hot_bytes, warm_bytes, cold_bytes;
+    };
+    Caretaker(Originator* originator, HistoryPolicy policy = HistoryPolicy(), bool verbose = true) :
+        originator_(originator), policy_(std::move(policy)), verbose_(verbose) {
+        if(!this->policy_.spill_path.empty()) {
+            this->fd_ = open(this->policy_.spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            Check(this->fd_ >= 0, "Caretaker: open segment");
+            this->index_fd_ = open(this->IndexPath().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(this->index_fd_ < 0) {
+                int error = errno;
+                close(this->fd_);
+                unlink(this->policy_.spill_path.c_str());
+                errno = error;
+                Check(false, "Caretaker: open index");
+            }
+        }
+    }
     ~Caretaker() {
-        for(auto m : mementos_)
-            delete m;
+        for(auto& hot : this->hot_)
+            delete hot.memento;
+        if(this->fd_ >= 0) {
+            close(this->fd_);
+            unlink(this->policy_.spill_path.c_str());
+            close(this->index_fd_);
+            unlink(this->IndexPath().c_str());
+        }
+    }
+    Usage usage() const {
+        return {this->hot_.size(), this->warm_.size(), this->cold_count_,
+                this->hot_bytes_, this->warm_bytes_, this->cold_bytes_};
     }
+    // The hot budget counts the full state of each memento, also the bytes a
+    // copy-on-write snapshot shares with its neighbours.
     void Backup() {
-        std::cout << "\nCaretaker: Saving Originator's state...\n";
-        this->mementos_.push_back(this->originator_->Save());
+        if(this->verbose_) {
+            std::cout << "\nCaretaker: Saving Originator's state...\n";
+        }
+        Memento* memento = this->originator_->Save();
+        SnapshotInfo info{};
+        info.size = this->originator_->state().size();
+        if(TimestampedMemento* stamped = dynamic_cast<TimestampedMemento*>(memento)) {
+            info.stamp = stamped->stamp();
+            stamped->preview().copy(info.preview, sizeof(info.preview) - 1);
+        }
+        this->hot_.push_back({info, memento});
+        this->hot_bytes_ += info.size;
+        while(this->hot_bytes_ > this->policy_.hot_bytes && this->hot_.size() > 1) {
+            this->Demote();
+        }
+        while(this->warm_bytes_ > this->policy_.warm_bytes) {
+            this->Spill();
+        }
     }
     void Undo() {
-        if(!this->mementos_.size())
+        if(this->hot_.empty() && this->warm_.empty() && this->cold_count_ == 0)
             return;
-        Memento* memento = this->mementos_.back();
-        this->mementos_.pop_back();
-        std::cout << "Caretaker: Restoring state to: " << memento->GetName() << "\n";
+        Memento* memento = this->TakeNewest();
+        if(this->verbose_) {
+            std::cout << "Caretaker: Restoring state to: " << memento->GetName() << "\n";
+        }
         try {
             this->originator_->Restore(memento);
         } catch (...) {
+            delete memento;
             this->Undo();
+            return;
         }
+        delete memento;
     }
     void ShowHistory() const {
         std::cout << "Caretaker: Here's the list of mementos:\n";
-        for (Memento* memento : this->mementos_) {
-            std::cout << memento->GetName() << "\n";
+        if(this->cold_count_) {
+            this->MapIndex([](const ColdEntry& entry) {
+                std::cout << Name(entry.info) << "\n";
+            });
+        }
+        for (const auto& warm : this->warm_) {
+            std::cout << Name(warm.info) << "\n";
+        }
+        for (const auto& hot : this->hot_) {
+            std::cout << Name(hot.info) << "\n";
         }
     }
 };
@@ -120,9 +729,250 @@ void ClientCode() {
     delete originator;
     delete caretaker;
 }
+// Edits states of 1 KB to 100 MB in a few places between snapshots, and
+// compares the memory kept by the history and the save and restore latency of
+// copy-on-write snapshots and of delta mementos with a keyframe every 8
+// snapshots.
+void BenchmarkDeltaMemento() {
+    const std::size_t kSnapshots = 16;
+    using Clock = std::chrono::steady_clock;
+    std::cout << "Benchmark: copy-on-write vs deltas, " << kSnapshots << " snapshots\n";
+    for(std::size_t size : {std::size_t(1) << 10, std::size_t(1) << 16, std::size_t(1) << 20,
+                            std::size_t(16) << 20, std::size_t(100) << 20}) {
+        for(std::size_t interval : {0, 8}) {
+            Originator originator(std::string(size, 'x'), false);
+            originator.set_keyframe_interval(interval);
+            std::vector<Memento*> history;
+            std::size_t stored = 0;
+            ChunkedState previous;
+            Clock::duration save_time{};
+            for(std::size_t i = 0; i < kSnapshots; i++) {
+                for(std::size_t edit = 0; edit < 4; edit++) {
+                    originator.Write(std::rand() % (size - 8), "12345678");
+                }
+                auto start = Clock::now();
+                history.push_back(originator.Save());
+                save_time += Clock::now() - start;
+                if(DeltaMemento* delta = dynamic_cast<DeltaMemento*>(history.back())) {
+                    stored += delta->stored_bytes();
+                } else {
+                    const ChunkedState& snapshot = static_cast<ConcreteMemento*>(history.back())->snapshot();
+                    stored += snapshot.UnsharedBytes(previous);
+                    previous = snapshot;
+                }
+            }
+            auto start = Clock::now();
+            originator.Restore(history.back());
+            Clock::duration restore_time = Clock::now() - start;
+            std::cout << " " << (size >> 10) << " KB " << (interval ? "delta" : "cow  ") << ": history "
+                      << stored / 1024.0 << " KB, save "
+                      << std::chrono::duration<double, std::micro>(save_time).count() / kSnapshots << " us, restore "
+                      << std::chrono::duration<double, std::micro>(restore_time).count() << " us\n";
+            for(Memento* memento : history) {
+                delete memento;
+            }
+        }
+    }
+}
+// The memento before copy-on-write snapshots: a deep copy of the state, for
+// comparison.
+class DeepCopyMemento : public TimestampedMemento {
+private:
+    std::string state_;
+public:
+    DeepCopyMemento(std::string state) : TimestampedMemento(state.substr(0, 9)), state_(std::move(state)) {}
+    std::string state() const override {
+        return this->state_;
+    }
+};
+// Reads a "Key:  n kB" line of /proc/self/status, 0 if there is none.
+std::size_t ReadStatusKb(const std::string& key) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status, line)) {
+        if(line.rfind(key + ":", 0) == 0) {
+            return std::stoul(line.substr(key.size() + 1));
+        }
+    }
+    return 0;
+}
+// A long edit session on a 4 MB state: a few small writes before each of 256
+// snapshots, then restores of random snapshots. Compares deep copies, deltas
+// and copy-on-write snapshots on save and restore latency and on the peak RSS
+// the session adds. Freed heap is trimmed first so that it doesn't hide the
+// growth, and the peak is reset through clear_refs where the kernel allows it.
+void BenchmarkCopyOnWrite() {
+    const std::size_t kSize = 4 << 20;
+    const std::size_t kSnapshots = 256;
+    using Clock = std::chrono::steady_clock;
+    std::cout << "\nBenchmark: edit session, " << (kSize >> 20) << " MB state, " << kSnapshots << " snapshots\n";
+    for(const char* mode : {"cow", "delta", "deep"}) {
+        malloc_trim(0);
+        std::ofstream("/proc/self/clear_refs") << "5";
+        std::size_t rss = ReadStatusKb("VmRSS");
+        Originator originator(std::string(kSize, 'x'), false);
+        originator.set_keyframe_interval(std::string(mode) == "delta" ? 8 : 0);
+        std::vector<Memento*> history;
+        Clock::duration save_time{};
+        for(std::size_t i = 0; i < kSnapshots; i++) {
+            for(std::size_t edit = 0; edit < 8; edit++) {
+                originator.Write(std::rand() % (kSize - 8), "12345678");
+            }
+            auto start = Clock::now();
+            if(std::string(mode) == "deep") {
+                history.push_back(new DeepCopyMemento(originator.state().str()));
+            } else {
+                history.push_back(originator.Save());
+            }
+            save_time += Clock::now() - start;
+        }
+        Clock::duration restore_time{};
+        for(std::size_t i = 0; i < kSnapshots; i++) {
+            Memento* memento = history[std::rand() % history.size()];
+            auto start = Clock::now();
+            originator.Restore(memento);
+            restore_time += Clock::now() - start;
+        }
+        std::cout << " " << mode << ": save "
+                  << std::chrono::duration<double, std::micro>(save_time).count() / kSnapshots << " us, restore "
+                  << std::chrono::duration<double, std::micro>(restore_time).count() / kSnapshots << " us, peak RSS +"
+                  << (ReadStatusKb("VmHWM") - rss) / 1024.0 << " MB\n";
+        for(Memento* memento : history) {
+            delete memento;
+        }
+    }
+}
+// Resident set size of the process from /proc/self/statm, in MB.
+double ResidentMb() {
+    std::ifstream statm("/proc/self/statm");
+    std::size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE) / double(1 << 20);
+}
+// Snapshots of a 4 KB state under a 4 MB hot and 16 MB warm budget, the rest
+// spilled to a segment file. RSS should level off once the budgets are full.
+// Then undoes through the hot and warm tiers into the cold one, up to 1000
+// undos there, and reports the undo latency of each tier. The segment file
+// takes about 2.3 KB per cold snapshot, 10^6 snapshots spill over 2 GB.
+void BenchmarkTieredHistory(std::size_t snapshots) {
+    const std::size_t kSize = 4 << 10;
+    const std::string path = (std::filesystem::temp_directory_path() / "memento.history").string();
+    using Clock = std::chrono::steady_clock;
+    std::cout << "\nBenchmark: tiered history, " << snapshots << " snapshots of " << (kSize >> 10) << " KB\n";
+    std::string text;
+    while(text.size() < kSize) {
+        text += "Super-duper-super-puper-super. ";
+    }
+    const std::string words[] = {"super-", "duper-", "puper-", "memento-", "caretaker-", "undo-"};
+    Originator originator(text.substr(0, kSize), false);
+    {
+        Caretaker caretaker(&originator, HistoryPolicy{4 << 20, 16 << 20, path}, false);
+        for(std::size_t i = 1; i <= snapshots; i++) {
+            for(std::size_t edit = 0; edit < 4; edit++) {
+                originator.Write(std::rand() % (kSize - 10), words[std::rand() % 6]);
+            }
+            caretaker.Backup();
+            if(i % std::max<std::size_t>(snapshots / 10, 1) == 0) {
+                Caretaker::Usage usage = caretaker.usage();
+                std::cout << " " << i << " snapshots: RSS " << ResidentMb() << " MB, hot " << usage.hot
+                          << ", warm " << usage.warm << " (" << (usage.warm_bytes >> 20) << " MB), cold "
+                          << usage.cold << " (" << (usage.cold_bytes >> 20) << " MB on disk)\n";
+            }
+        }
+        const char* names[] = {"hot", "warm", "cold"};
+        Clock::duration time[3] = {};
+        std::size_t count[3] = {};
+        while(count[2] < 1000) {
+            Caretaker::Usage usage = caretaker.usage();
+            if(!usage.hot && !usage.warm && !usage.cold) {
+                break;
+            }
+            int tier = usage.hot ? 0 : usage.warm ? 1 : 2;
+            auto start = Clock::now();
+            caretaker.Undo();
+            time[tier] += Clock::now() - start;
+            count[tier]++;
+        }
+        for(int tier = 0; tier < 3; tier++) {
+            if(!count[tier]) {
+                continue;
+            }
+            std::cout << " undo " << names[tier] << ": "
+                      << std::chrono::duration<double, std::micro>(time[tier]).count() / count[tier]
+                      << " us over " << count[tier] << " undos\n";
+        }
+    }
+}
+// Snapshots a small unchanged state as fast as it can and counts what each
+// Save() allocates, then compares stamping a memento with what its
+// constructor did before: std::time, std::ctime and the date kept as a
+// string. Names are formatted on demand, here for a page of history.
+void BenchmarkSnapshotRate() {
+    const std::size_t kSnapshots = 1000000;
+    using Clock = std::chrono::steady_clock;
+    std::cout << "\nBenchmark: snapshot rate, " << kSnapshots << " snapshots\n";
+    Originator originator(std::string(64, 'x'), false);
+    std::vector<Memento*> history;
+    history.reserve(kSnapshots);
+    std::size_t allocations = g_allocations;
+    auto start = Clock::now();
+    for(std::size_t i = 0; i < kSnapshots; i++) {
+        history.push_back(originator.Save());
+    }
+    double save_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kSnapshots;
+    allocations = g_allocations - allocations;
+    std::cout << " Save: " << 1000 / save_ns << " M snapshots/s, "
+              << double(allocations) / kSnapshots << " allocations per snapshot\n";
+
+    std::size_t length = 0;
+    allocations = g_allocations;
+    start = Clock::now();
+    for(std::size_t i = 0; i < kSnapshots; i++) {
+        std::time_t now = std::time(0);
+        std::string date = std::ctime(&now);
+        length += date.size();
+    }
+    double ctime_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kSnapshots;
+    std::size_t ctime_allocations = g_allocations - allocations;
+    std::uint64_t ids = 0;
+    allocations = g_allocations;
+    start = Clock::now();
+    for(std::size_t i = 0; i < kSnapshots; i++) {
+        ids += Stamp::Now().id;
+    }
+    double stamp_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kSnapshots;
+    std::size_t stamp_allocations = g_allocations - allocations;
+    std::cout << " time + ctime + string: " << ctime_ns << " ns, " << double(ctime_allocations) / kSnapshots
+              << " allocations per stamp\n";
+    std::cout << " Stamp::Now: " << stamp_ns << " ns, " << double(stamp_allocations) / kSnapshots
+              << " allocations per stamp\n";
 
-int main() {
+    start = Clock::now();
+    for(std::size_t i = 0; i < 1000; i++) {
+        length += history[i]->GetName().size();
+    }
+    std::cout << " GetName on demand: "
+              << std::chrono::duration<double, std::nano>(Clock::now() - start).count() / 1000 << " ns per name\n";
+    // Keeps the timed loops from being optimized away.
+    volatile std::uint64_t sink = length + ids;
+    (void)sink;
+    for(Memento* memento : history) {
+        delete memento;
+    }
+}
+
+// The tiered history benchmark takes the number of snapshots as its only
+// argument, by default 20000, which spills a few tens of MB.
+int main(int argc, char* argv[]) {
+    std::size_t snapshots = argc > 1 ? std::stoul(argv[1]) : 20000;
     std::srand(static_cast<unsigned int>(std::time(NULL)));
     ClientCode();
-    return 0;
+    std::cout << "\n";
+    bool passed = CheckCorruptBlocks();
+    std::cout << "\n";
+    BenchmarkDeltaMemento();
+    BenchmarkCopyOnWrite();
+    BenchmarkTieredHistory(snapshots);
+    BenchmarkSnapshotRate();
+    return passed ? 0 : 1;
 }
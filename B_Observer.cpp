@@ -5,14 +5,35 @@
     can be referred as publisher. All other objects that want to track changes 
     to the publisher's stae are called subscribers.
 */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <latch>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+// Messages are shared read-only by all the observers they go to.
+typedef std::shared_ptr<const std::string> Message;
 class IObserver {
 public:
     virtual ~IObserver() {}
     virtual void Update(const std::string& message_from_subject) = 0;
+    // Observers that keep the message can override this one and share it.
+    virtual void Update(const Message& message_from_subject) {
+        this->Update(*message_from_subject);
+    }
 };
 class ISubject {
 public:
@@ -21,6 +42,9 @@ public:
     virtual void Detach(IObserver* observer) = 0;
     virtual void Notify() = 0;
 };
+// Not safe to use from several threads, so it has no fan-out over a
+// NotifyPool: the workers would read the list while Attach and Detach change
+// it. ConcurrentSubject has one.
 class Subject : public ISubject {
 public:
     virtual ~Subject() {
@@ -34,24 +58,469 @@ public:
     }
     void Notify() override {
         std::list<IObserver*>::iterator itr = list_observer_.begin();
-        std::cout << "There are " << list_observer_.size() << " observers in the list.\n";
         while(itr != list_observer_.end()) {
-            (*itr)->Update(message_);
+            (*itr)->Update(this->message_);
             itr++;
         }
     }
     void CreateMessage(std::string message = "EMPTY") {
-        this->message_ = message;
+        this->message_ = std::make_shared<const std::string>(std::move(message));
+        HowManyObserver();
         Notify();
     }
+    void HowManyObserver() {
+        std::cout << "There are " << list_observer_.size() << " observers in the list.\n";
+    }
     void SomeBusinessLogic() {
-        this->message_ = "change message message";
+        this->message_ = std::make_shared<const std::string>("change message message");
+        HowManyObserver();
         Notify();
         std::cout << "I am about to do something important\n";
     }
 private:
     std::list<IObserver*> list_observer_;
-    std::string message_;
+    Message message_ = std::make_shared<const std::string>();
+};
+// Small ids for the threads reading a ConcurrentSubject, so that a subject
+// can keep one slot per reader thread. An id is given back when its thread
+// exits.
+class ReaderId {
+public:
+    static constexpr std::size_t kMaxReaders = 128;
+    static std::size_t Get() {
+        thread_local ReaderId reader;
+        return reader.id_;
+    }
+private:
+    inline static std::atomic<bool> claimed_[kMaxReaders] = {};
+    std::size_t id_;
+    ReaderId() {
+        for(std::size_t i = 0; i < kMaxReaders; i++) {
+            bool expected = false;
+            if(claimed_[i].compare_exchange_strong(expected, true)) {
+                this->id_ = i;
+                return;
+            }
+        }
+        throw std::runtime_error("ReaderId: too many reader threads");
+    }
+    ~ReaderId() {
+        claimed_[this->id_].store(false, std::memory_order_release);
+    }
+};
+// Worker threads for fan-out notifications, each with a bounded queue of
+// tasks. Post hands a task to the first worker from its hint with room and
+// blocks while all the queues are full, so that slow observers hold the
+// notifier back instead of letting the queues grow. A worker can't wait for
+// room in the queues it drains, so a task it posts while they are full runs
+// inline.
+class NotifyPool {
+public:
+    NotifyPool(std::size_t threads, std::size_t queue_capacity = 16) : capacity_(std::max<std::size_t>(queue_capacity, 1)) {
+        for(std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++) {
+            this->workers_.push_back(std::make_unique<Worker>());
+        }
+        for(auto& worker : this->workers_) {
+            worker->thread = std::thread(&NotifyPool::Run, this, worker.get());
+        }
+    }
+    ~NotifyPool() {
+        for(auto& worker : this->workers_) {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->stop = true;
+            worker->not_empty.notify_one();
+        }
+        for(auto& worker : this->workers_) {
+            worker->thread.join();
+        }
+    }
+    std::size_t size() const {
+        return this->workers_.size();
+    }
+    // True on the threads of this pool.
+    bool InWorker() const {
+        return current_pool_ == this;
+    }
+    void Post(std::size_t hint, std::function<void()> task) {
+        this->pending_++;
+        for(std::size_t i = 0; i < this->workers_.size(); i++) {
+            Worker& worker = *this->workers_[(hint + i) % this->workers_.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if(worker.tasks.size() < this->capacity_) {
+                worker.tasks.push_back(std::move(task));
+                worker.not_empty.notify_one();
+                return;
+            }
+        }
+        if(this->InWorker()) {
+            task();
+            this->Done();
+            return;
+        }
+        Worker& worker = *this->workers_[hint % this->workers_.size()];
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.not_full.wait(lock, [&] { return worker.tasks.size() < this->capacity_; });
+        worker.tasks.push_back(std::move(task));
+        worker.not_empty.notify_one();
+    }
+    // Blocks until every task posted so far has run.
+    void Drain() {
+        std::unique_lock<std::mutex> lock(this->drain_mutex_);
+        this->drained_.wait(lock, [&] { return this->pending_.load() == 0; });
+    }
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::deque<std::function<void()>> tasks;
+        bool stop = false;
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::size_t capacity_;
+    std::atomic<std::size_t> pending_{0};
+    std::mutex drain_mutex_;
+    std::condition_variable drained_;
+    inline static thread_local const NotifyPool* current_pool_ = nullptr;
+
+    void Done() {
+        if(--this->pending_ == 0) {
+            std::lock_guard<std::mutex> lock(this->drain_mutex_);
+            this->drained_.notify_all();
+        }
+    }
+    void Run(Worker* worker) {
+        current_pool_ = this;
+        for(;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(worker->mutex);
+                worker->not_empty.wait(lock, [&] { return worker->stop || !worker->tasks.empty(); });
+                if(worker->tasks.empty()) {
+                    return;
+                }
+                task = std::move(worker->tasks.front());
+                worker->tasks.pop_front();
+                worker->not_full.notify_one();
+            }
+            task();
+            this->Done();
+        }
+    }
+};
+// Subject safe to notify, attach and detach from any threads. The observers
+// are an immutable array published read-copy-update style: Notify takes no
+// lock and iterates the array it finds, Attach and Detach publish a changed
+// copy under a writer mutex. The old array is freed after a grace period,
+// once every reader that could have loaded it has left Notify, so that when
+// Detach returns no Notify is still calling the observer. Writers wait for
+// the grace period after releasing the mutex, so an Update may attach and
+// detach while another thread waits for its Notify. Writers called from an
+// Update can't wait for their own Notify; they leave the old array to the
+// next writer.
+// Large observer sets can be fanned out over a NotifyPool in partitions.
+// Partitions keep their array alive, but Detach doesn't wait for
+// notifications that weren't waited for, drain the pool before deleting
+// their observers.
+class ConcurrentSubject : public ISubject {
+public:
+    ConcurrentSubject() : snapshot_(new Snapshot(std::make_shared<const Observers>())) {}
+    ~ConcurrentSubject() {
+        delete this->snapshot_.load();
+        for(const auto& retired : this->retired_) {
+            delete retired.second;
+        }
+    }
+    void Attach(IObserver* observer) override {
+        std::unique_lock<std::mutex> lock(this->writer_mutex_);
+        auto observers = std::make_shared<Observers>(**this->snapshot_.load());
+        observers->push_back(observer);
+        this->Publish(lock, new Snapshot(std::move(observers)));
+    }
+    // Attaches a whole set in one copy, attaching one by one copies the
+    // array each time.
+    void Attach(const std::vector<IObserver*>& added) {
+        std::unique_lock<std::mutex> lock(this->writer_mutex_);
+        auto observers = std::make_shared<Observers>(**this->snapshot_.load());
+        observers->insert(observers->end(), added.begin(), added.end());
+        this->Publish(lock, new Snapshot(std::move(observers)));
+    }
+    void Detach(IObserver* observer) override {
+        std::unique_lock<std::mutex> lock(this->writer_mutex_);
+        const Observers& current = **this->snapshot_.load();
+        if(std::find(current.begin(), current.end(), observer) == current.end()) {
+            return;
+        }
+        auto observers = std::make_shared<Observers>();
+        observers->reserve(current.size() - 1);
+        std::remove_copy(current.begin(), current.end(), std::back_inserter(*observers), observer);
+        this->Publish(lock, new Snapshot(std::move(observers)));
+    }
+    // Notifies the message set by CreateMessage, only safe from one thread.
+    void Notify() override {
+        this->Notify(this->message_);
+    }
+    void Notify(const Message& message) {
+        this->Read([&](const Snapshot& snapshot) {
+            for(IObserver* observer : *snapshot) {
+                observer->Update(message);
+            }
+        });
+    }
+    // Fans the message out over the pool in partitions of at least
+    // kMinPartition observers, smaller sets are notified inline. With wait,
+    // returns once every observer has been updated. Waiting from a pool
+    // worker notifies inline, the partitions could be queued behind it.
+    void Notify(const Message& message, NotifyPool& pool, bool wait) {
+        const std::size_t kMinPartition = 256;
+        this->Read([&](const Snapshot& snapshot) {
+            std::size_t size = snapshot->size();
+            if(size <= kMinPartition || (wait && pool.InWorker())) {
+                for(IObserver* observer : *snapshot) {
+                    observer->Update(message);
+                }
+                return;
+            }
+            std::size_t partitions = std::min(pool.size() * 4, (size + kMinPartition - 1) / kMinPartition);
+            std::latch done(wait ? partitions : 0);
+            std::latch* latch = wait ? &done : nullptr;
+            for(std::size_t p = 0; p < partitions; p++) {
+                std::size_t begin = size * p / partitions;
+                std::size_t end = size * (p + 1) / partitions;
+                pool.Post(p, [snapshot, message, begin, end, latch] {
+                    for(std::size_t i = begin; i < end; i++) {
+                        (*snapshot)[i]->Update(message);
+                    }
+                    if(latch) {
+                        latch->count_down();
+                    }
+                });
+            }
+            done.wait();
+        });
+    }
+    void CreateMessage(std::string message = "EMPTY") {
+        this->message_ = std::make_shared<const std::string>(std::move(message));
+        Notify();
+    }
+private:
+    typedef std::vector<IObserver*> Observers;
+    // Notifications fanned out keep a reference to the array they go over.
+    typedef std::shared_ptr<const Observers> Snapshot;
+    // The epoch a reader entered Notify in, 0 outside of Notify.
+    struct alignas(64) ReaderSlot {
+        std::atomic<std::uint64_t> epoch{0};
+    };
+    std::atomic<const Snapshot*> snapshot_;
+    std::atomic<std::uint64_t> epoch_{1};
+    ReaderSlot slots_[ReaderId::kMaxReaders];
+    std::mutex writer_mutex_;
+    // Replaced arrays with the epoch they were retired in.
+    std::vector<std::pair<std::uint64_t, const Snapshot*>> retired_;
+    Message message_ = std::make_shared<const std::string>();
+
+    // Calls read with the current array from inside a read-side section.
+    template<typename Reader>
+    void Read(Reader read) {
+        ReaderSlot& slot = this->slots_[ReaderId::Get()];
+        // A Notify from an Update is covered by the outer one.
+        bool outer = slot.epoch.load(std::memory_order_relaxed) == 0;
+        if(outer) {
+            slot.epoch.store(this->epoch_.load());
+        }
+        read(*this->snapshot_.load());
+        if(outer) {
+            slot.epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    // Swaps next in under the writer mutex held by lock, then releases it.
+    // A reader that loaded a retired array entered before the epoch it was
+    // retired in, so the grace period is over once every slot is either empty
+    // or in that epoch or a later one. The arrays retired up to then are freed.
+    void Publish(std::unique_lock<std::mutex>& lock, const Snapshot* next) {
+        const Snapshot* previous = this->snapshot_.exchange(next);
+        std::uint64_t epoch = this->epoch_.fetch_add(1) + 1;
+        this->retired_.emplace_back(epoch, previous);
+        lock.unlock();
+        if(this->slots_[ReaderId::Get()].epoch.load(std::memory_order_relaxed) != 0) {
+            return;
+        }
+        for(ReaderSlot& slot : this->slots_) {
+            for(std::uint64_t seen = slot.epoch.load(); seen != 0 && seen < epoch; seen = slot.epoch.load()) {
+                std::this_thread::yield();
+            }
+        }
+        lock.lock();
+        auto expired = std::partition(this->retired_.begin(), this->retired_.end(),
+                                      [epoch](const auto& retired) { return retired.first > epoch; });
+        for(auto it = expired; it != this->retired_.end(); ++it) {
+            delete it->second;
+        }
+        this->retired_.erase(expired, this->retired_.end());
+    }
+};
+// Subject delivering each message only to the observers subscribed to its
+// topic. Topics are levels separated by '/'. A filter level "+" matches any
+// one level and a last level "#" matches any remaining levels, "sports/#"
+// matches "sports" and everything below it. Exact filters are kept in an
+// inverted index from topic to observers, wildcard filters in a trie by
+// level. Publish resolves a topic once into an array of its observers and
+// reuses it until the subscriptions change. An observer with several
+// matching filters gets the message once per filter.
+class TopicSubject : public ISubject {
+public:
+    void Subscribe(const std::string& filter, IObserver* observer) {
+        std::vector<std::string_view> levels = Split(filter);
+        if(!IsWildcard(levels)) {
+            this->exact_[filter].push_back(observer);
+            this->routes_.erase(filter);
+            return;
+        }
+        TrieNode* node = &this->root_;
+        for(std::string_view level : levels) {
+            auto& child = node->children[std::string(level)];
+            if(!child) {
+                child = std::make_unique<TrieNode>();
+            }
+            node = child.get();
+        }
+        node->observers.push_back(observer);
+        this->routes_.clear();
+    }
+    void Unsubscribe(const std::string& filter, IObserver* observer) {
+        std::vector<std::string_view> levels = Split(filter);
+        if(!IsWildcard(levels)) {
+            auto it = this->exact_.find(filter);
+            if(it != this->exact_.end()) {
+                Remove(it->second, observer);
+                this->routes_.erase(filter);
+            }
+            return;
+        }
+        TrieNode* node = &this->root_;
+        for(std::string_view level : levels) {
+            auto it = node->children.find(level);
+            if(it == node->children.end()) {
+                return;
+            }
+            node = it->second.get();
+        }
+        Remove(node->observers, observer);
+        this->routes_.clear();
+    }
+    // Attached observers get every topic.
+    void Attach(IObserver* observer) override {
+        this->Subscribe("#", observer);
+    }
+    // Removes every subscription of the observer.
+    void Detach(IObserver* observer) override {
+        for(auto& entry : this->exact_) {
+            Remove(entry.second, observer);
+        }
+        RemoveAll(this->root_, observer);
+        this->routes_.clear();
+    }
+    void Notify() override {
+        this->Publish(this->topic_, this->message_);
+    }
+    void CreateMessage(std::string topic, std::string message = "EMPTY") {
+        this->topic_ = std::move(topic);
+        this->message_ = std::make_shared<const std::string>(std::move(message));
+        Notify();
+    }
+    // Returns the number of observers the message went to.
+    std::size_t Publish(std::string_view topic, const Message& message) {
+        auto it = this->routes_.find(topic);
+        if(it == this->routes_.end()) {
+            if(this->routes_.size() >= kMaxRoutes) {
+                this->routes_.clear();
+            }
+            it = this->routes_.emplace(std::string(topic), this->Resolve(topic)).first;
+        }
+        for(IObserver* observer : it->second) {
+            observer->Update(message);
+        }
+        return it->second.size();
+    }
+private:
+    struct TopicHash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view topic) const {
+            return std::hash<std::string_view>{}(topic);
+        }
+    };
+    template<typename Value>
+    using TopicMap = std::unordered_map<std::string, Value, TopicHash, std::equal_to<>>;
+    struct TrieNode {
+        TopicMap<std::unique_ptr<TrieNode>> children;
+        std::vector<IObserver*> observers;
+    };
+    // Resolved topics kept before the cache starts over.
+    static constexpr std::size_t kMaxRoutes = 1 << 16;
+    TopicMap<std::vector<IObserver*>> exact_;
+    TrieNode root_;
+    TopicMap<std::vector<IObserver*>> routes_;
+    std::string topic_;
+    Message message_ = std::make_shared<const std::string>();
+
+    static std::vector<std::string_view> Split(std::string_view topic) {
+        std::vector<std::string_view> levels;
+        for(std::size_t begin = 0;; ) {
+            std::size_t end = topic.find('/', begin);
+            levels.push_back(topic.substr(begin, end == std::string_view::npos ? end : end - begin));
+            if(end == std::string_view::npos) {
+                return levels;
+            }
+            begin = end + 1;
+        }
+    }
+    static bool IsWildcard(const std::vector<std::string_view>& levels) {
+        bool wildcard = false;
+        for(std::size_t i = 0; i < levels.size(); i++) {
+            if(levels[i] == "#" && i + 1 != levels.size()) {
+                throw std::invalid_argument("TopicSubject: # must be the last level of a filter");
+            }
+            wildcard = wildcard || levels[i] == "+" || levels[i] == "#";
+        }
+        return wildcard;
+    }
+    static void Remove(std::vector<IObserver*>& observers, IObserver* observer) {
+        observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+    }
+    static void RemoveAll(TrieNode& node, IObserver* observer) {
+        Remove(node.observers, observer);
+        for(auto& child : node.children) {
+            RemoveAll(*child.second, observer);
+        }
+    }
+    static void Match(const TrieNode& node, const std::vector<std::string_view>& levels, std::size_t i,
+                      std::vector<IObserver*>& out) {
+        auto rest = node.children.find(std::string_view("#"));
+        if(rest != node.children.end()) {
+            out.insert(out.end(), rest->second->observers.begin(), rest->second->observers.end());
+        }
+        if(i == levels.size()) {
+            out.insert(out.end(), node.observers.begin(), node.observers.end());
+            return;
+        }
+        for(std::string_view level : {levels[i], std::string_view("+")}) {
+            auto child = node.children.find(level);
+            if(child != node.children.end()) {
+                Match(*child->second, levels, i + 1, out);
+            }
+        }
+    }
+    std::vector<IObserver*> Resolve(std::string_view topic) const {
+        std::vector<IObserver*> observers;
+        auto exact = this->exact_.find(topic);
+        if(exact != this->exact_.end()) {
+            observers = exact->second;
+        }
+        Match(this->root_, Split(topic), 0, observers);
+        return observers;
+    }
 };
 class Observer : public IObserver {
 public:
@@ -64,6 +533,9 @@ public:
         std::cout << "Goodbye, I was the Observer \"" << this->number_ << "\".\n";
     }
     void Update(const std::string& message_from_subject) override {
+        this->Update(std::make_shared<const std::string>(message_from_subject));
+    }
+    void Update(const Message& message_from_subject) override {
         message_from_subject_ = message_from_subject;
         PrintInfo();
     }
@@ -73,13 +545,13 @@ public:
     }
     void PrintInfo() {
         std::cout << "Observer \"" << this->number_ << "\": a message is available --> "
-                  << this->message_from_subject_ << "\n";
+                  << *this->message_from_subject_ << "\n";
     }
 private:
     Subject& subject_;
     static int static_number_;
     int number_;
-    std::string message_from_subject_;
+    Message message_from_subject_ = std::make_shared<const std::string>();
 };
 int Observer::static_number_ = 0;
 void ClientCode() {
@@ -108,7 +580,327 @@ void ClientCode() {
     delete observer1;
     delete subject;
 }
+// Observer for the benchmarks, counting updates per thread so that
+// notifiers on different threads don't share a counter.
+class CountingObserver : public IObserver {
+public:
+    inline static thread_local std::size_t updates_ = 0;
+    using IObserver::Update;
+    void Update(const std::string&) override {
+        updates_++;
+    }
+};
+// The list subject behind a mutex, for comparison.
+class LockedSubject : public ISubject {
+public:
+    void Attach(IObserver* observer) override {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->observers_.push_back(observer);
+    }
+    void Detach(IObserver* observer) override {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->observers_.remove(observer);
+    }
+    void Notify() override {
+        this->Notify(this->message_);
+    }
+    void Notify(const Message& message) {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        for(IObserver* observer : this->observers_) {
+            observer->Update(message);
+        }
+    }
+private:
+    std::mutex mutex_;
+    std::list<IObserver*> observers_;
+    Message message_ = std::make_shared<const std::string>();
+};
+// Notifier threads notify 100 observers while churn threads keep attaching
+// and detaching observers of their own. Reports the percentiles of the
+// notify latency and the attach/detach rate, for the RCU subject and the
+// locked list.
+template<typename SubjectType>
+void BenchmarkNotify(const char* name) {
+    const std::size_t kObservers = 100;
+    const std::size_t kNotifiers = 4;
+    const std::size_t kChurners = 2;
+    const std::size_t kNotifies = 50000;
+    using Clock = std::chrono::steady_clock;
+    SubjectType subject;
+    std::vector<CountingObserver> observers(kObservers + kChurners * 16);
+    for(std::size_t i = 0; i < kObservers; i++) {
+        subject.Attach(&observers[i]);
+    }
+    std::atomic<std::size_t> running{kNotifiers};
+    std::atomic<std::size_t> changes{0};
+    std::vector<std::vector<Clock::duration>> latencies(kNotifiers);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for(std::size_t t = 0; t < kNotifiers; t++) {
+        threads.emplace_back([&, t] {
+            const Message message = std::make_shared<const std::string>("benchmark");
+            latencies[t].reserve(kNotifies);
+            for(std::size_t i = 0; i < kNotifies; i++) {
+                auto begin = Clock::now();
+                subject.Notify(message);
+                latencies[t].push_back(Clock::now() - begin);
+            }
+            if(CountingObserver::updates_ < kNotifies * kObservers) {
+                std::cout << "  missed updates\n";
+            }
+            running--;
+        });
+    }
+    for(std::size_t t = 0; t < kChurners; t++) {
+        threads.emplace_back([&, t] {
+            CountingObserver* own = &observers[kObservers + t * 16];
+            for(std::size_t i = 0; running.load(); i++) {
+                subject.Attach(&own[i % 16]);
+                subject.Detach(&own[(i + 8) % 16]);
+                changes += 2;
+            }
+        });
+    }
+    for(std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::vector<Clock::duration> all;
+    for(const auto& thread_latencies : latencies) {
+        all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        return std::chrono::duration<double, std::micro>(all[std::size_t(p * (all.size() - 1))]).count();
+    };
+    std::cout << " " << name << ": notify p50 " << percentile(0.5) << " us, p99 " << percentile(0.99)
+              << " us, p99.9 " << percentile(0.999) << " us, max " << percentile(1.0) << " us; "
+              << changes / seconds << " attach/detach per s\n";
+}
+// Observer attaching and detaching a helper from inside its Update.
+class ReentrantObserver : public IObserver {
+public:
+    explicit ReentrantObserver(ConcurrentSubject& subject) : subject_(subject) {}
+    using IObserver::Update;
+    void Update(const std::string&) override {
+        this->subject_.Attach(&this->helper_);
+        this->subject_.Detach(&this->helper_);
+    }
+private:
+    ConcurrentSubject& subject_;
+    CountingObserver helper_;
+};
+// Notifier threads notify observers which attach and detach from their
+// Update, while churn threads attach and detach too. A writer holding the
+// writer mutex through its grace period would deadlock with such an Update.
+// Returns false if the subject doesn't end with just the observers attached
+// at the start.
+bool StressReentrant() {
+    const std::size_t kObservers = 8;
+    const std::size_t kNotifiers = 3;
+    const std::size_t kNotifies = 2000;
+    ConcurrentSubject subject;
+    std::vector<std::unique_ptr<ReentrantObserver>> reentrant;
+    std::vector<CountingObserver> counting(kObservers + 2);
+    for(std::size_t i = 0; i < kObservers; i++) {
+        reentrant.push_back(std::make_unique<ReentrantObserver>(subject));
+        subject.Attach(reentrant.back().get());
+        subject.Attach(&counting[i]);
+    }
+    std::atomic<std::size_t> running{kNotifiers};
+    std::vector<std::thread> threads;
+    for(std::size_t t = 0; t < kNotifiers; t++) {
+        threads.emplace_back([&] {
+            const Message message = std::make_shared<const std::string>("stress");
+            for(std::size_t i = 0; i < kNotifies; i++) {
+                subject.Notify(message);
+            }
+            running--;
+        });
+    }
+    threads.emplace_back([&] {
+        for(std::size_t i = 0; running.load(); i++) {
+            subject.Attach(&counting[kObservers + i % 2]);
+            subject.Detach(&counting[kObservers + i % 2]);
+        }
+    });
+    for(std::thread& thread : threads) {
+        thread.join();
+    }
+    CountingObserver::updates_ = 0;
+    subject.Notify(std::make_shared<const std::string>("check"));
+    bool passed = CountingObserver::updates_ == kObservers;
+    std::cout << "\nStress: " << kNotifiers << " notifiers over observers attaching from Update, "
+              << CountingObserver::updates_ << " of " << kObservers << " observers left attached\n";
+    return passed;
+}
+// Notify before any CreateMessage sends an empty message, as the subjects did
+// when the message was a plain string.
+bool CheckNotifyBeforeMessage() {
+    CountingObserver observer;
+    Subject subject;
+    ConcurrentSubject concurrent;
+    TopicSubject topics;
+    subject.Attach(&observer);
+    concurrent.Attach(&observer);
+    topics.Attach(&observer);
+    CountingObserver::updates_ = 0;
+    subject.Notify();
+    concurrent.Notify();
+    topics.Notify();
+    std::cout << "\nNotify before a message: " << CountingObserver::updates_ << " of 3 subjects sent an empty one\n";
+    return CountingObserver::updates_ == 3;
+}
+// A pool task posting more tasks than its worker's queue holds, then waiting
+// on a fan-out over the same pool. Both would block the worker on itself.
+bool CheckNestedPost() {
+    const std::size_t kNested = 8;
+    const std::size_t kObservers = 1024;
+    NotifyPool pool(1, 1);
+    ConcurrentSubject subject;
+    std::vector<CountingObserver> observers(kObservers);
+    std::vector<IObserver*> attached;
+    for(CountingObserver& observer : observers) {
+        attached.push_back(&observer);
+    }
+    subject.Attach(attached);
+    std::atomic<std::size_t> ran{0};
+    std::size_t updates = 0;
+    pool.Post(0, [&] {
+        for(std::size_t i = 0; i < kNested; i++) {
+            pool.Post(0, [&] { ran++; });
+        }
+        CountingObserver::updates_ = 0;
+        subject.Notify(std::make_shared<const std::string>("nested"), pool, true);
+        updates = CountingObserver::updates_;
+    });
+    pool.Drain();
+    std::cout << "\nNested posts on a full pool: " << ran << " of " << kNested << " tasks ran, "
+              << updates << " of " << kObservers << " observers updated\n";
+    return ran == kNested && updates == kObservers;
+}
+// Notifies 10 to 10^6 observers inline, fanned out over a pool waiting for
+// the updates, and fanned out fire-and-forget with the pool drained at the
+// end. Reports the latency of a notification and the update throughput.
+void BenchmarkFanOut() {
+    const std::size_t kUpdates = 10000000;
+    using Clock = std::chrono::steady_clock;
+    NotifyPool pool(std::max(2u, std::thread::hardware_concurrency()));
+    std::cout << "\nBenchmark: fan-out over " << pool.size() << " pool threads\n";
+    const Message message = std::make_shared<const std::string>("benchmark");
+    for(std::size_t size = 10; size <= 1000000; size *= 10) {
+        ConcurrentSubject subject;
+        std::vector<CountingObserver> observers(size);
+        std::vector<IObserver*> attached;
+        for(CountingObserver& observer : observers) {
+            attached.push_back(&observer);
+        }
+        subject.Attach(attached);
+        std::size_t notifies = std::max<std::size_t>(kUpdates / size, 10);
+        auto measure = [&](auto notify) {
+            auto start = Clock::now();
+            for(std::size_t i = 0; i < notifies; i++) {
+                notify();
+            }
+            pool.Drain();
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            std::cout << seconds / notifies * 1e6 << " us, " << notifies * size / seconds / 1e6 << " M updates/s";
+        };
+        std::cout << " " << size << " observers: inline ";
+        measure([&] { subject.Notify(message); });
+        std::cout << "; wait ";
+        measure([&] { subject.Notify(message, pool, true); });
+        std::cout << "; fire-and-forget ";
+        measure([&] { subject.Notify(message, pool, false); });
+        std::cout << "\n";
+    }
+}
+// Observer for the topic benchmark, keeping messages that start with its
+// topic, so that it can also filter a broadcast itself.
+class TopicObserver : public IObserver {
+public:
+    explicit TopicObserver(std::string topic) : topic_(std::move(topic) + ":") {}
+    using IObserver::Update;
+    void Update(const std::string& message) override {
+        if(message.compare(0, this->topic_.size(), this->topic_) == 0) {
+            this->delivered_++;
+        }
+    }
+    std::size_t delivered() const {
+        return this->delivered_;
+    }
+private:
+    std::string topic_;
+    std::size_t delivered_ = 0;
+};
+// 10^5 observers subscribed to one of 10^3 topics each, messages published to
+// random topics. Compares messages delivered per second through the topic
+// index with broadcasting every message to every observer and letting it
+// filter.
+void BenchmarkTopics() {
+    const std::size_t kObservers = 100000;
+    const std::size_t kTopics = 1000;
+    const std::size_t kMessages = 20000;
+    using Clock = std::chrono::steady_clock;
+    std::cout << "\nBenchmark: " << kObservers << " observers over " << kTopics << " topics\n";
+    std::vector<std::string> topics;
+    std::vector<Message> messages;
+    for(std::size_t t = 0; t < kTopics; t++) {
+        topics.push_back("news/" + std::to_string(t));
+        messages.push_back(std::make_shared<const std::string>(topics.back() + ":payload"));
+    }
+    std::vector<TopicObserver> observers;
+    observers.reserve(kObservers);
+    for(std::size_t i = 0; i < kObservers; i++) {
+        observers.emplace_back(topics[i % kTopics]);
+    }
+    std::vector<std::size_t> order(kMessages);
+    for(std::size_t& topic : order) {
+        topic = std::rand() % kTopics;
+    }
+
+    TopicSubject routed;
+    for(std::size_t i = 0; i < kObservers; i++) {
+        routed.Subscribe(topics[i % kTopics], &observers[i]);
+    }
+    auto start = Clock::now();
+    std::size_t routed_deliveries = 0;
+    for(std::size_t topic : order) {
+        routed_deliveries += routed.Publish(topics[topic], messages[topic]);
+    }
+    double routed_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<IObserver*> broadcast;
+    for(TopicObserver& observer : observers) {
+        broadcast.push_back(&observer);
+    }
+    const std::size_t kBroadcasts = kMessages / 100;
+    start = Clock::now();
+    for(std::size_t m = 0; m < kBroadcasts; m++) {
+        for(IObserver* observer : broadcast) {
+            observer->Update(messages[order[m]]);
+        }
+    }
+    double broadcast_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::size_t delivered = 0;
+    for(const TopicObserver& observer : observers) {
+        delivered += observer.delivered();
+    }
+    std::size_t broadcast_deliveries = delivered - routed_deliveries;
+    std::cout << " topic index: " << routed_deliveries / routed_seconds / 1e6 << " M delivered/s, "
+              << kMessages / routed_seconds << " messages/s\n";
+    std::cout << " broadcast and filter: " << broadcast_deliveries / broadcast_seconds / 1e6 << " M delivered/s, "
+              << kBroadcasts / broadcast_seconds << " messages/s\n";
+}
 int main() {
     ClientCode();
-    return 0;
+    std::cout << "\nBenchmark: 4 notifiers, 2 churn threads, 100 observers\n";
+    BenchmarkNotify<ConcurrentSubject>("rcu   ");
+    BenchmarkNotify<LockedSubject>("locked");
+    bool passed = StressReentrant();
+    passed = CheckNestedPost() && passed;
+    passed = CheckNotifyBeforeMessage() && passed;
+    BenchmarkFanOut();
+    BenchmarkTopics();
+    return passed ? 0 : 1;
 }
@@ -8,8 +8,22 @@
     object called as context, stores a reference to one of the state objects that 
     represents its current state and delegates all state-related work to that object
 */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <span>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
 #include <typeinfo>
+#include <utility>
+#include <vector>
 
 class Context;
 class State {
@@ -70,13 +84,590 @@ void ConcreteStateA::Handle1() {
     std::cout << "ConcreteStateA wants to change the state of the context.\n";
     this->context_->TransitionTo(new ConcreteStateB());
 }
+// One entry of a transition table: the state to go to and an optional
+// action, called with the state left and the event.
+template<typename StateId, typename Event>
+struct Transition {
+    StateId next;
+    void (*action)(StateId from, Event event);
+};
+// State machine driven by the constexpr table of a Machine, indexed by
+// (state, event). States are enum values instead of objects, so a transition
+// is a table load and the action: no allocation, no virtual call, no RTTI.
+// Machine provides the StateId and Event enums, kStates, kEvents, kTable and
+// kStateNames. Tracing is off unless a trace callback is set.
+template<typename Machine>
+class TableContext {
+public:
+    using StateId = typename Machine::StateId;
+    using Event = typename Machine::Event;
+    using Trace = std::function<void(StateId from, Event event, StateId to)>;
+    explicit TableContext(StateId initial = StateId{}) : state_(initial) {}
+    StateId state() const {
+        return this->state_;
+    }
+    void set_trace(Trace trace) {
+        this->trace_ = std::move(trace);
+    }
+    void Dispatch(Event event) {
+        const Transition<StateId, Event>& transition =
+            Machine::kTable[static_cast<std::size_t>(this->state_)][static_cast<std::size_t>(event)];
+        if(transition.action) {
+            transition.action(this->state_, event);
+        }
+        if(this->trace_) {
+            this->trace_(this->state_, event, transition.next);
+        }
+        this->state_ = transition.next;
+    }
+    static const char* Name(StateId state) {
+        return Machine::kStateNames[static_cast<std::size_t>(state)];
+    }
+private:
+    StateId state_;
+    Trace trace_;
+};
+// ConcreteStateA and ConcreteStateB as a table.
+struct ABMachine {
+    enum class StateId : std::uint8_t { kA, kB };
+    enum class Event : std::uint8_t { kRequest1, kRequest2 };
+    static constexpr std::size_t kStates = 2;
+    static constexpr std::size_t kEvents = 2;
+    static void HandleA1(StateId, Event) {
+        std::cout << "StateA handles request1.\n";
+        std::cout << "StateA wants to change the state of the context.\n";
+    }
+    static void HandleA2(StateId, Event) {
+        std::cout << "StateA handles request2.\n";
+    }
+    static void HandleB1(StateId, Event) {
+        std::cout << "StateB handles request1.\n";
+    }
+    static void HandleB2(StateId, Event) {
+        std::cout << "StateB handles request2.\n";
+        std::cout << "StateB wants to change the state of the context.\n";
+    }
+    static constexpr Transition<StateId, Event> kTable[kStates][kEvents] = {
+        {{StateId::kB, &HandleA1}, {StateId::kA, &HandleA2}},
+        {{StateId::kB, &HandleB1}, {StateId::kA, &HandleB2}},
+    };
+    static constexpr const char* kStateNames[kStates] = {"StateA", "StateB"};
+};
+// A connection handshake, the shape of a protocol machine. Its only action
+// counts the connections established.
+struct HandshakeMachine {
+    enum class StateId : std::uint8_t { kClosed, kSynSent, kEstablished, kFinWait };
+    enum class Event : std::uint8_t { kConnect, kSynAck, kClose, kAck };
+    static constexpr std::size_t kStates = 4;
+    static constexpr std::size_t kEvents = 4;
+    inline static std::size_t established_ = 0;
+    static void Established(StateId, Event) {
+        established_++;
+    }
+    static constexpr Transition<StateId, Event> kTable[kStates][kEvents] = {
+        {{StateId::kSynSent, nullptr}, {StateId::kClosed, nullptr}, {StateId::kClosed, nullptr}, {StateId::kClosed, nullptr}},
+        {{StateId::kSynSent, nullptr}, {StateId::kEstablished, &Established}, {StateId::kClosed, nullptr}, {StateId::kSynSent, nullptr}},
+        {{StateId::kEstablished, nullptr}, {StateId::kEstablished, nullptr}, {StateId::kFinWait, nullptr}, {StateId::kEstablished, nullptr}},
+        {{StateId::kFinWait, nullptr}, {StateId::kFinWait, nullptr}, {StateId::kFinWait, nullptr}, {StateId::kClosed, nullptr}},
+    };
+    static constexpr const char* kStateNames[kStates] = {"Closed", "SynSent", "Established", "FinWait"};
+};
+// Runs many instances of a Machine at once. Their states are one byte each
+// in a single array, and Apply moves every instance by one event in a pass
+// over it. Small tables are applied as a branch-free select over every
+// (state, event) pair, which the compiler vectorizes; larger ones are looked
+// up. The pass goes in blocks, and only the instances whose transition has an
+// action in the table are handed to the effect callback, with the state they
+// left and the event.
+template<typename Machine>
+class BulkMachine {
+public:
+    using StateId = typename Machine::StateId;
+    using Event = typename Machine::Event;
+    static_assert(Machine::kStates <= 256 && sizeof(StateId) == 1 && sizeof(Event) == 1);
+    explicit BulkMachine(std::size_t instances, StateId initial = StateId{}) :
+        states_(instances, static_cast<std::uint8_t>(initial)) {}
+    std::size_t size() const {
+        return this->states_.size();
+    }
+    std::size_t bytes() const {
+        return this->states_.capacity();
+    }
+    StateId state(std::size_t instance) const {
+        return static_cast<StateId>(this->states_[instance]);
+    }
+    // events holds one event per instance, throws std::invalid_argument
+    // otherwise.
+    template<typename OnEffect>
+    void Apply(std::span<const Event> events, OnEffect on_effect) {
+        if(events.size() != this->states_.size()) {
+            throw std::invalid_argument("BulkMachine::Apply: " + std::to_string(events.size()) + " events for "
+                                        + std::to_string(this->states_.size()) + " instances");
+        }
+        const std::size_t kBlock = 4096;
+        // The block is copied to local arrays, which the compiler knows can't
+        // alias the states, so that it vectorizes without alias checks.
+        std::uint8_t from[kBlock];
+        std::uint8_t block_events[kBlock];
+        std::uint8_t effect[kBlock];
+        for(std::size_t begin = 0; begin < this->states_.size(); begin += kBlock) {
+            std::size_t n = std::min(kBlock, this->states_.size() - begin);
+            std::uint8_t* states = this->states_.data() + begin;
+            std::memcpy(from, states, n);
+            std::memcpy(block_events, events.data() + begin, n);
+            // Full blocks have a constant trip count, which -O2 needs to
+            // vectorize.
+            if(n == kBlock) {
+                for(std::size_t i = 0; i < kBlock; i++) {
+                    states[i] = Step(from[i], block_events[i], effect[i]);
+                }
+            } else {
+                for(std::size_t i = 0; i < n; i++) {
+                    states[i] = Step(from[i], block_events[i], effect[i]);
+                }
+            }
+            // Effects are rare, so skip eight instances at a time.
+            std::size_t i = 0;
+            for(; i + 8 <= n; i += 8) {
+                std::uint64_t any;
+                std::memcpy(&any, effect + i, sizeof(any));
+                if(any) {
+                    for(std::size_t j = i; j < i + 8; j++) {
+                        if(effect[j]) {
+                            on_effect(begin + j, static_cast<StateId>(from[j]), static_cast<Event>(block_events[j]));
+                        }
+                    }
+                }
+            }
+            for(; i < n; i++) {
+                if(effect[i]) {
+                    on_effect(begin + i, static_cast<StateId>(from[i]), static_cast<Event>(block_events[i]));
+                }
+            }
+        }
+    }
+private:
+    static constexpr std::size_t kPairs = Machine::kStates * Machine::kEvents;
+    static constexpr std::uint8_t Next(std::size_t pair) {
+        return static_cast<std::uint8_t>(Machine::kTable[pair / Machine::kEvents][pair % Machine::kEvents].next);
+    }
+    static constexpr std::uint8_t Effect(std::size_t pair) {
+        return Machine::kTable[pair / Machine::kEvents][pair % Machine::kEvents].action != nullptr;
+    }
+    std::vector<std::uint8_t> states_;
+
+    static std::uint8_t Step(std::uint8_t state, std::uint8_t event, std::uint8_t& effect) {
+        if constexpr(kPairs <= 64) {
+            return Select(state, event, effect, std::make_index_sequence<kPairs>());
+        } else {
+            static constexpr auto kNext = [] {
+                std::array<std::uint8_t, kPairs> next{};
+                for(std::size_t p = 0; p < kPairs; p++) {
+                    next[p] = Next(p);
+                }
+                return next;
+            }();
+            static constexpr auto kEffect = [] {
+                std::array<std::uint8_t, kPairs> effects{};
+                for(std::size_t p = 0; p < kPairs; p++) {
+                    effects[p] = Effect(p);
+                }
+                return effects;
+            }();
+            std::size_t pair = state * Machine::kEvents + event;
+            effect = kEffect[pair];
+            return kNext[pair];
+        }
+    }
+    template<std::size_t... kPair>
+    static std::uint8_t Select(std::uint8_t state, std::uint8_t event, std::uint8_t& effect, std::index_sequence<kPair...>) {
+        std::uint8_t next = state;
+        std::uint8_t effects = 0;
+        // Masks rather than conditionals, which the vectorizer takes as is.
+        auto apply = [&](std::size_t pair) {
+            std::uint8_t hit = -std::uint8_t((state == pair / Machine::kEvents) & (event == pair % Machine::kEvents));
+            next = (next & ~hit) | (Next(pair) & hit);
+            effects |= hit & Effect(pair);
+        };
+        (apply(kPair), ...);
+        effect = effects;
+        return next;
+    }
+};
+// A state of a hierarchical machine: its parent, -1 for a top state, the
+// child entered when the state is the target of a transition, -1 for a leaf,
+// and its entry and exit actions.
+struct HsmState {
+    int parent;
+    int initial;
+    void (*entry)();
+    void (*exit)();
+};
+// What a state does with an event: go to target with action, run action
+// without leaving the state (kInternal), or leave the event to its parent
+// (kUnhandled).
+struct HsmHandler {
+    static constexpr int kUnhandled = -1;
+    static constexpr int kInternal = -2;
+    int target = kUnhandled;
+    void (*action)() = nullptr;
+};
+// Flattens the hierarchy of a Machine into a table over (leaf, event) at
+// compile time. An entry holds the leaf to end in and every action of the
+// transition in order: the exits up to the innermost state enclosing both
+// the handling state and the target, the transition action, the entries down
+// to the target and into its initial substates. Transitions are external as
+// in UML: one from a state to itself, to an ancestor or to a descendant exits
+// and re-enters that state. Machine provides StateId, Event, kStates,
+// kEvents, kInitial, kStateTable and kHandlers.
+template<typename Machine>
+class FlatHsm {
+public:
+    using Action = void (*)();
+    static constexpr std::size_t kMaxActions = 2 * Machine::kStates + 1;
+    struct Entry {
+        std::uint8_t next;
+        std::uint8_t count;
+        Action actions[kMaxActions];
+    };
+    // Resolves an event by walking up from the state, as a runtime HSM does
+    // on every dispatch.
+    static constexpr Entry Resolve(std::size_t state, std::size_t event) {
+        Entry entry{static_cast<std::uint8_t>(state), 0, {}};
+        int handler_state = static_cast<int>(state);
+        while(handler_state >= 0 && Machine::kHandlers[handler_state][event].target == HsmHandler::kUnhandled) {
+            handler_state = Machine::kStateTable[handler_state].parent;
+        }
+        if(handler_state < 0) {
+            return entry;
+        }
+        const HsmHandler& handler = Machine::kHandlers[handler_state][event];
+        if(handler.target == HsmHandler::kInternal) {
+            Add(entry, handler.action);
+            return entry;
+        }
+        int common = Ancestor(handler_state, handler.target);
+        if(common == handler_state || common == handler.target) {
+            common = Machine::kStateTable[common].parent;
+        }
+        for(int s = static_cast<int>(state); s != common; s = Machine::kStateTable[s].parent) {
+            Add(entry, Machine::kStateTable[s].exit);
+        }
+        Add(entry, handler.action);
+        int path[Machine::kStates] = {};
+        int length = 0;
+        for(int s = handler.target; s != common; s = Machine::kStateTable[s].parent) {
+            path[length++] = s;
+        }
+        while(length > 0) {
+            Add(entry, Machine::kStateTable[path[--length]].entry);
+        }
+        int leaf = handler.target;
+        while(Machine::kStateTable[leaf].initial >= 0) {
+            leaf = Machine::kStateTable[leaf].initial;
+            Add(entry, Machine::kStateTable[leaf].entry);
+        }
+        entry.next = static_cast<std::uint8_t>(leaf);
+        return entry;
+    }
+    static constexpr auto Flatten() {
+        std::array<std::array<Entry, Machine::kEvents>, Machine::kStates> table{};
+        for(std::size_t state = 0; state < Machine::kStates; state++) {
+            for(std::size_t event = 0; event < Machine::kEvents; event++) {
+                table[state][event] = Resolve(state, event);
+            }
+        }
+        return table;
+    }
+private:
+    static constexpr void Add(Entry& entry, Action action) {
+        if(action) {
+            entry.actions[entry.count++] = action;
+        }
+    }
+    // Deepest state that is a or an ancestor of a and also b or an ancestor
+    // of b, -1 when they only share the top.
+    static constexpr int Ancestor(int a, int b) {
+        bool above_a[Machine::kStates] = {};
+        for(int s = a; s >= 0; s = Machine::kStateTable[s].parent) {
+            above_a[s] = true;
+        }
+        int s = b;
+        while(s >= 0 && !above_a[s]) {
+            s = Machine::kStateTable[s].parent;
+        }
+        return s;
+    }
+};
+// Context of a hierarchical machine. It is always in a leaf state, and a
+// dispatch is one lookup in the flattened table and the actions it lists.
+template<typename Machine>
+class HsmContext {
+public:
+    using StateId = typename Machine::StateId;
+    using Event = typename Machine::Event;
+    HsmContext() {
+        int leaf = Machine::kInitial;
+        for(int s = leaf; s >= 0; s = Machine::kStateTable[s].initial) {
+            leaf = s;
+            if(Machine::kStateTable[s].entry) {
+                Machine::kStateTable[s].entry();
+            }
+        }
+        this->state_ = static_cast<std::uint8_t>(leaf);
+    }
+    StateId state() const {
+        return static_cast<StateId>(this->state_);
+    }
+    void Dispatch(Event event) {
+        const auto& entry = kTable[this->state_][static_cast<std::size_t>(event)];
+        for(std::size_t i = 0; i < entry.count; i++) {
+            entry.actions[i]();
+        }
+        this->state_ = entry.next;
+    }
+    // The same dispatch resolving the event at runtime, for comparison.
+    void DispatchWalking(Event event) {
+        auto entry = FlatHsm<Machine>::Resolve(this->state_, static_cast<std::size_t>(event));
+        for(std::size_t i = 0; i < entry.count; i++) {
+            entry.actions[i]();
+        }
+        this->state_ = entry.next;
+    }
+private:
+    // Built here rather than in FlatHsm, whose functions can only run at
+    // compile time once it is complete.
+    static constexpr auto kTable = FlatHsm<Machine>::Flatten();
+    std::uint8_t state_;
+};
+// A device that is Off, or On and then Idle or Busy. Power is handled by On
+// for both of its substates. Work while Busy restarts it, a self-transition
+// which exits and re-enters Busy.
+struct DeviceMachine {
+    enum class StateId : std::uint8_t { kOff, kOn, kIdle, kBusy };
+    enum class Event : std::uint8_t { kPower, kWork, kDone };
+    static constexpr std::size_t kStates = 4;
+    static constexpr std::size_t kEvents = 3;
+    static constexpr int kInitial = 0;
+    static void EnterOff() { std::cout << "Device: enter Off.\n"; }
+    static void EnterOn() { std::cout << "Device: enter On.\n"; }
+    static void ExitOn() { std::cout << "Device: exit On.\n"; }
+    static void EnterIdle() { std::cout << "Device: enter Idle.\n"; }
+    static void ExitIdle() { std::cout << "Device: exit Idle.\n"; }
+    static void EnterBusy() { std::cout << "Device: enter Busy.\n"; }
+    static void ExitBusy() { std::cout << "Device: exit Busy.\n"; }
+    static constexpr HsmState kStateTable[kStates] = {
+        {-1, -1, &EnterOff, nullptr},
+        {-1, 2, &EnterOn, &ExitOn},
+        {1, -1, &EnterIdle, &ExitIdle},
+        {1, -1, &EnterBusy, &ExitBusy},
+    };
+    static constexpr HsmHandler kHandlers[kStates][kEvents] = {
+        {{1, nullptr}, {}, {}},
+        {{0, nullptr}, {}, {}},
+        {{}, {3, nullptr}, {}},
+        {{}, {3, nullptr}, {2, nullptr}},
+    };
+};
+// kDepth states nested in one another, the innermost a leaf. Tick is handled
+// by the outermost state without a transition, Reset by a self-transition
+// of it that exits and enters every level.
+template<std::size_t kDepth>
+struct NestedMachine {
+    enum class StateId : std::uint8_t {};
+    enum class Event : std::uint8_t { kTick, kReset };
+    static constexpr std::size_t kStates = kDepth;
+    static constexpr std::size_t kEvents = 2;
+    static constexpr int kInitial = 0;
+    inline static std::size_t actions_ = 0;
+    static void Count() {
+        actions_++;
+    }
+    static constexpr auto kStateTable = [] {
+        std::array<HsmState, kStates> states{};
+        for(std::size_t s = 0; s < kStates; s++) {
+            states[s] = {int(s) - 1, s + 1 < kStates ? int(s) + 1 : -1, &Count, &Count};
+        }
+        return states;
+    }();
+    static constexpr auto kHandlers = [] {
+        std::array<std::array<HsmHandler, kEvents>, kStates> handlers{};
+        handlers[0][0] = {HsmHandler::kInternal, &Count};
+        handlers[0][1] = {0, nullptr};
+        return handlers;
+    }();
+};
 void ClientCode() {
     Context* context = new Context(new ConcreteStateA());
     context->Request1();
     context->Request2();
     delete context;
 }
+void HsmClientCode() {
+    using Event = DeviceMachine::Event;
+    HsmContext<DeviceMachine> device;
+    for(Event event : {Event::kPower, Event::kWork, Event::kWork, Event::kPower, Event::kPower, Event::kDone}) {
+        device.Dispatch(event);
+    }
+}
+void TableClientCode() {
+    TableContext<ABMachine> context;
+    context.set_trace([](ABMachine::StateId, ABMachine::Event, ABMachine::StateId to) {
+        std::cout << "TableContext: Transition to " << TableContext<ABMachine>::Name(to) << ".\n";
+    });
+    context.Dispatch(ABMachine::Event::kRequest1);
+    context.Dispatch(ABMachine::Event::kRequest2);
+}
+// Stream buffer dropping everything, to time the printing paths without a
+// terminal.
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+    std::streamsize xsputn(const char*, std::streamsize n) override {
+        return n;
+    }
+};
+// Transitions per second of TransitionTo, of the table with the same printing
+// actions, both into a null buffer, and of the table running the handshake
+// machine.
+void BenchmarkTransitions() {
+    const std::size_t kTransitions = 2000000;
+    using Clock = std::chrono::steady_clock;
+    auto rate = [&](std::size_t transitions, Clock::time_point start) {
+        return transitions / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+    };
+    NullBuffer null_buffer;
+    std::streambuf* console = std::cout.rdbuf(&null_buffer);
+    auto start = Clock::now();
+    {
+        Context context(new ConcreteStateA());
+        for(std::size_t i = 0; i < kTransitions / 2; i++) {
+            context.Request1();
+            context.Request2();
+        }
+    }
+    double transition_to = rate(kTransitions, start);
+    start = Clock::now();
+    TableContext<ABMachine> ab;
+    for(std::size_t i = 0; i < kTransitions / 2; i++) {
+        ab.Dispatch(ABMachine::Event::kRequest1);
+        ab.Dispatch(ABMachine::Event::kRequest2);
+    }
+    double table_printing = rate(kTransitions, start);
+    std::cout.rdbuf(console);
+
+    const std::size_t kHandshakes = 100 * kTransitions;
+    using Event = HandshakeMachine::Event;
+    const Event cycle[] = {Event::kConnect, Event::kSynAck, Event::kClose, Event::kAck};
+    TableContext<HandshakeMachine> handshake;
+    start = Clock::now();
+    for(std::size_t i = 0; i < kHandshakes; i++) {
+        handshake.Dispatch(cycle[i % 4]);
+    }
+    double table = rate(kHandshakes, start);
+    std::cout << "\nBenchmark: transitions\n"
+              << " TransitionTo: " << transition_to << " M/s\n"
+              << " table, printing actions: " << table_printing << " M/s\n"
+              << " table, handshake: " << table << " M/s (ends in "
+              << TableContext<HandshakeMachine>::Name(handshake.state()) << ")\n";
+}
+// 10^7 handshake instances, each given one random event per batch. Compares
+// events per second and bytes per instance of BulkMachine with a vector of
+// TableContexts dispatching one by one; the heap-allocated State of a
+// Context is given for scale. Returns false if the two end in different
+// states or count different effects, or if a short batch isn't rejected.
+bool BenchmarkBulk() {
+    const std::size_t kInstances = 10000000;
+    const std::size_t kBatches = 8;
+    using Clock = std::chrono::steady_clock;
+    using Event = HandshakeMachine::Event;
+    std::vector<std::vector<Event>> batches(kBatches, std::vector<Event>(kInstances));
+    for(auto& batch : batches) {
+        for(Event& event : batch) {
+            event = static_cast<Event>(std::rand() % 4);
+        }
+    }
+    std::cout << "\nBenchmark: " << kInstances << " instances, " << kBatches << " batches of mixed events\n";
+
+    BulkMachine<HandshakeMachine> bulk(kInstances);
+    std::size_t effects = 0;
+    auto start = Clock::now();
+    for(const auto& batch : batches) {
+        bulk.Apply(batch, [&](std::size_t, HandshakeMachine::StateId, Event) {
+            effects++;
+        });
+    }
+    double bulk_rate = kInstances * kBatches / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+
+    std::vector<TableContext<HandshakeMachine>> contexts(kInstances);
+    HandshakeMachine::established_ = 0;
+    start = Clock::now();
+    for(const auto& batch : batches) {
+        for(std::size_t i = 0; i < kInstances; i++) {
+            contexts[i].Dispatch(batch[i]);
+        }
+    }
+    double table_rate = kInstances * kBatches / std::chrono::duration<double>(Clock::now() - start).count() / 1e6;
+    std::size_t mismatches = 0;
+    for(std::size_t i = 0; i < kInstances; i++) {
+        mismatches += contexts[i].state() != bulk.state(i);
+    }
+    bool effects_match = effects == HandshakeMachine::established_;
+    std::cout << " BulkMachine: " << bulk_rate << " M events/s, " << double(bulk.bytes()) / kInstances
+              << " bytes per instance, " << effects << " effects\n"
+              << " TableContext: " << table_rate << " M events/s, " << sizeof(TableContext<HandshakeMachine>)
+              << " bytes per instance, " << HandshakeMachine::established_ << " effects, "
+              << mismatches << " states differ, effect counts " << (effects_match ? "match" : "differ") << "\n"
+              << " Context: " << sizeof(Context) + sizeof(ConcreteStateA)
+              << " bytes per instance plus the heap block of its State\n";
+    try {
+        bulk.Apply(std::span<const Event>(batches[0]).first(kInstances - 1), [](std::size_t, HandshakeMachine::StateId, Event) {});
+        std::cout << " a short batch was applied\n";
+        return false;
+    } catch(const std::invalid_argument& e) {
+        std::cout << " rejected: " << e.what() << "\n";
+    }
+    return mismatches == 0 && effects_match;
+}
+// Dispatch cost at nesting depths 1 to 8, with the flattened table and with
+// the event resolved by walking up the hierarchy on every dispatch.
+template<std::size_t kDepth>
+void BenchmarkHsmDepth() {
+    const std::size_t kDispatches = 5000000;
+    using Clock = std::chrono::steady_clock;
+    using Event = typename NestedMachine<kDepth>::Event;
+    HsmContext<NestedMachine<kDepth>> context;
+    auto time = [&](Event event, bool walking) {
+        auto start = Clock::now();
+        for(std::size_t i = 0; i < kDispatches; i++) {
+            if(walking) {
+                context.DispatchWalking(event);
+            } else {
+                context.Dispatch(event);
+            }
+        }
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kDispatches;
+    };
+    std::cout << " depth " << kDepth << ": tick " << time(Event::kTick, false) << " ns flat, "
+              << time(Event::kTick, true) << " ns walking; reset " << time(Event::kReset, false) << " ns flat, "
+              << time(Event::kReset, true) << " ns walking\n";
+}
+void BenchmarkHsm() {
+    std::cout << "\nBenchmark: hierarchical dispatch\n";
+    [&]<std::size_t... kDepth>(std::index_sequence<kDepth...>) {
+        (BenchmarkHsmDepth<kDepth + 1>(), ...);
+    }(std::make_index_sequence<8>());
+}
 int main() {
     ClientCode();
-    return 0;
+    std::cout << "\n";
+    TableClientCode();
+    std::cout << "\n";
+    HsmClientCode();
+    BenchmarkTransitions();
+    bool passed = BenchmarkBulk();
+    BenchmarkHsm();
+    return passed ? 0 : 1;
 }
@@ -10,10 +10,20 @@
     existing ones without changing the code of context or other strategies.
 */
 
-#include <iostream>
 #include <algorithm>
-#include <string_view>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 class Strategy {
 public:
@@ -54,6 +64,208 @@ public:
         return result;
     }
 };
+class InsertionSortStrategy: public Strategy {
+public:
+    std::string doAlgorithm(std::string_view data) const override {
+        std::string result(data);
+        for(std::size_t i = 1; i < result.size(); i++) {
+            char c = result[i];
+            std::size_t j = i;
+            for(; j > 0 && result[j - 1] > c; j--) {
+                result[j] = result[j - 1];
+            }
+            result[j] = c;
+        }
+        return result;
+    }
+};
+class CountingSortStrategy: public Strategy {
+public:
+    std::string doAlgorithm(std::string_view data) const override {
+        std::array<std::size_t, 256> count{};
+        for(char c : data) {
+            count[static_cast<unsigned char>(c)]++;
+        }
+        // Where char is signed, bytes 128..255 are the negative values and come first in std::sort
+        const std::size_t first = std::numeric_limits<char>::is_signed ? 128 : 0;
+        std::string result;
+        result.reserve(data.size());
+        for(std::size_t i = 0; i < 256; i++) {
+            std::size_t byte = (i + first) % 256;
+            result.append(count[byte], static_cast<char>(byte));
+        }
+        return result;
+    }
+};
+// Routes each call to the candidate that has measured fastest for inputs of that size class.
+// Only every period-th call is timed, so the common path is a countdown and a virtual call.
+// The period keeps clock reads under 1% of the time spent in the strategy itself, but the
+// selection as a whole doesn't stay under 1% of the call below about 256 bytes: the lookup,
+// the countdown and the extra call cost a few ns, 5-20% of a 12-70 ns sort of 4 to 64 bytes.
+class AdaptiveContext {
+public:
+    static constexpr std::size_t kClasses = 65;   // by bit width of the input size, 0 to 64
+    static constexpr unsigned kMinPeriod = 16;    // calls between samples, at least
+    static constexpr std::size_t kWarmup = 8;     // samples of every candidate before choosing
+    static constexpr double kAlpha = 0.25;        // weight of a new sample in the average
+    static constexpr double kExplore = 16;        // exploring costs at most 1/kExplore of sampled time
+    static constexpr double kDrift = 2;           // a sample of the chosen one this far off its average looks like drift
+    static constexpr int kDriftRun = 8;           // after this many in a row, measure everything again
+private:
+    struct Candidate {
+        std::string name;
+        std::unique_ptr<Strategy> strategy;
+    };
+    struct Arm {
+        double ns = 0;
+        unsigned samples = 0;
+        int drift = 0;
+    };
+    struct SizeClass {
+        unsigned countdown = 1;
+        const Strategy* chosen = nullptr;
+        std::size_t best = 0;
+        std::size_t next = 0;      // next candidate to warm up or explore
+        double budget = 0;         // sampled ns earned towards the next exploration
+        bool warm = false;
+        std::vector<Arm> arms;
+    };
+    std::vector<Candidate> candidates_;
+    std::array<SizeClass, kClasses> classes_;
+    double clock_ns_;
+    std::size_t samples_ = 0, explorations_ = 0, rewarms_ = 0;
+
+    using Clock = std::chrono::steady_clock;
+
+    static double ClockCost() {
+        const int kReads = 1000;
+        auto start = Clock::now();
+        for(int i = 0; i < kReads - 1; i++) {
+            (void)Clock::now();
+        }
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / kReads;
+    }
+    void Rewarm(SizeClass& size_class) {
+        size_class.arms.assign(candidates_.size(), Arm{});
+        size_class.warm = false;
+        size_class.next = 0;
+        size_class.budget = 0;
+        size_class.countdown = 1;
+    }
+    std::size_t Pick(SizeClass& size_class) {
+        std::size_t count = candidates_.size();
+        if(!size_class.warm) {
+            return size_class.next % count;
+        }
+        if(count > 1) {
+            std::size_t other = (size_class.best + 1 + size_class.next % (count - 1)) % count;
+            if(size_class.budget >= kExplore * size_class.arms[other].ns) {
+                size_class.budget = 0;
+                size_class.next++;
+                explorations_++;
+                return other;
+            }
+        }
+        return size_class.best;
+    }
+    void Record(SizeClass& size_class, std::size_t index, double ns) {
+        Arm& arm = size_class.arms[index];
+        if(arm.samples == 0) {
+            arm.ns = ns;
+        } else if(!size_class.warm) {
+            // Warming up keeps the quickest sample, anything slower is likely a preemption
+            arm.ns = std::min(arm.ns, ns);
+        } else {
+            double ratio = ns / arm.ns;
+            if(ratio > kDrift || ratio * kDrift < 1) {
+                // Samples this far off leave the average alone, so a lone outlier doesn't move it
+                // and a real change keeps looking like one. Count the run of them, restarting when
+                // the direction flips.
+                int direction = ratio > 1 ? 1 : -1;
+                arm.drift = arm.drift * direction > 0 ? arm.drift + direction : direction;
+            } else {
+                arm.drift = 0;
+                arm.ns += kAlpha * (ns - arm.ns);
+            }
+        }
+        arm.samples++;
+        if(size_class.warm && std::abs(arm.drift) >= kDriftRun) {
+            if(index == size_class.best) {
+                rewarms_++;
+                this->Rewarm(size_class);
+                return;
+            }
+            // Other candidates are only explored now and then, take their new level as it is
+            arm.ns = ns;
+            arm.drift = 0;
+        }
+        if(!size_class.warm) {
+            size_class.next++;
+            size_class.warm = size_class.next == kWarmup * candidates_.size();
+            if(size_class.warm) {
+                size_class.next = 0;
+            }
+        } else if(index == size_class.best) {
+            size_class.budget += ns;
+        }
+        for(std::size_t i = 0; i < size_class.arms.size(); i++) {
+            if(size_class.arms[i].samples > 0 && size_class.arms[i].ns < size_class.arms[size_class.best].ns) {
+                size_class.best = i;
+            }
+        }
+        size_class.chosen = candidates_[size_class.best].strategy.get();
+    }
+    std::string Sample(SizeClass& size_class, std::string_view data) {
+        if(candidates_.empty()) {
+            // Sample again next call, there is nothing to choose yet
+            size_class.countdown = 1;
+            std::cout << "AdaptiveContext: No strategy registered\n";
+            return {};
+        }
+        if(size_class.arms.size() != candidates_.size()) {
+            this->Rewarm(size_class);
+        }
+        std::size_t index = this->Pick(size_class);
+        auto start = Clock::now();
+        std::string result = candidates_[index].strategy->doAlgorithm(data);
+        // A coarse clock can read 0 ns, which the averages and the period divide by
+        double ns = std::max(1.0, std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+        samples_++;
+        this->Record(size_class, index, ns);
+        size_class.countdown = 1;
+        if(size_class.warm) {
+            double period = 200 * clock_ns_ / size_class.arms[size_class.best].ns;
+            size_class.countdown = std::max<unsigned>(kMinPeriod, static_cast<unsigned>(period));
+        }
+        return result;
+    }
+public:
+    AdaptiveContext() : clock_ns_(ClockCost()) {}
+    void addStrategy(std::string name, std::unique_ptr<Strategy> &&strategy) {
+        candidates_.push_back({std::move(name), std::move(strategy)});
+        for(SizeClass& size_class : classes_) {
+            size_class.arms.clear();
+        }
+    }
+    std::string doAlgorithm(std::string_view data) {
+        SizeClass& size_class = classes_[std::bit_width(data.size())];
+        if(--size_class.countdown != 0) {
+            return size_class.chosen->doAlgorithm(data);
+        }
+        return this->Sample(size_class, data);
+    }
+    // Name of the candidate currently chosen for inputs of this size, empty without candidates
+    const std::string& choice(std::size_t size) const {
+        static const std::string kNone;
+        if(candidates_.empty()) {
+            return kNone;
+        }
+        return candidates_[classes_[std::bit_width(size)].best].name;
+    }
+    std::size_t samples() const { return samples_; }
+    std::size_t explorations() const { return explorations_; }
+    std::size_t rewarms() const { return rewarms_; }
+};
 void ClientCode() {
     Context context(std::make_unique<ConcreteStrategyA>());
     std::cout << "Client: Strategy is set to normal sorting.\n";
@@ -63,7 +275,148 @@ void ClientCode() {
     context.setStrategy(std::make_unique<ConcreteStrategyB>());
     context.doSomeBusinessLogic();
 }
+std::vector<std::pair<std::string, std::unique_ptr<Strategy>>> SortingStrategies() {
+    std::vector<std::pair<std::string, std::unique_ptr<Strategy>>> strategies;
+    strategies.emplace_back("insertion", std::make_unique<InsertionSortStrategy>());
+    strategies.emplace_back("std::sort", std::make_unique<ConcreteStrategyA>());
+    strategies.emplace_back("counting", std::make_unique<CountingSortStrategy>());
+    return strategies;
+}
+void AdaptiveClientCode() {
+    AdaptiveContext context;
+    for(auto& [name, strategy] : SortingStrategies()) {
+        context.addStrategy(name, std::move(strategy));
+    }
+    std::string small = "aecbd", large(4096, ' ');
+    for(char& c : large) {
+        c = static_cast<char>('a' + std::rand() % 26);
+    }
+    for(int i = 0; i < 1000; i++) {
+        context.doAlgorithm(small);
+        context.doAlgorithm(large);
+        context.doAlgorithm("");
+    }
+    AdaptiveContext empty;
+    for(int i = 0; i < 2; i++) {
+        empty.doAlgorithm(small);
+    }
+    std::cout << "Client: An empty adaptive context has chosen \"" << empty.choice(small.size()) << "\"\n";
+    std::cout << "\nClient: Adaptive context sorts \"" << context.doAlgorithm(small) << "\" with "
+              << context.choice(small.size()) << " and 4096 characters with " << context.choice(large.size()) << "\n";
+}
+// Inputs of one size, either uniformly random or sorted with a few swaps
+std::vector<std::string> MakeInputs(std::size_t size, bool nearly_sorted) {
+    const std::size_t kInputs = 64;
+    std::vector<std::string> inputs(kInputs, std::string(size, ' '));
+    for(std::string& input : inputs) {
+        for(char& c : input) {
+            c = static_cast<char>('a' + std::rand() % 26);
+        }
+        if(nearly_sorted) {
+            std::sort(input.begin(), input.end());
+            for(std::size_t i = 0; i < size / 32; i++) {
+                std::swap(input[std::rand() % size], input[std::rand() % size]);
+            }
+        }
+    }
+    return inputs;
+}
+template <typename Sort>
+double TimeCalls(const std::vector<std::string>& inputs, std::size_t calls, Sort&& sort) {
+    using Clock = std::chrono::steady_clock;
+    std::size_t checksum = 0;
+    auto start = Clock::now();
+    for(std::size_t i = 0; i < calls; i++) {
+        checksum += sort(inputs[i % inputs.size()]).back();
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+    // Keeps the sorts from being optimized away
+    volatile std::size_t sink = checksum;
+    (void)sink;
+    return ns;
+}
+double Median(std::vector<double> values) {
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+void BenchmarkAdaptive() {
+    const std::size_t kBytes = std::size_t(1) << 24;   // per size and phase
+    const std::size_t kSizes[] = {4, 16, 64, 256, 1024};
+    const std::size_t kRounds = 15;
+    std::vector<std::pair<std::string, std::unique_ptr<Strategy>>> fixed = SortingStrategies();
+    AdaptiveContext context;
+    for(auto& [name, strategy] : SortingStrategies()) {
+        context.addStrategy(name, std::move(strategy));
+    }
+    std::cout << "\nBenchmark: sorting strings, oracle is the fastest fixed strategy per size\n";
+    double oracle_total = 0, adaptive_total = 0;
+    std::size_t matches = 0, runs = 0;
+    // Random input after nearly sorted slows insertion sort several times over where it was
+    // chosen, which the context should detect as drift
+    for(bool nearly_sorted : {true, false}) {
+        std::size_t rewarms = context.rewarms();
+        std::cout << (nearly_sorted ? " nearly sorted input\n" : " random input (after drift)\n");
+        for(std::size_t size : kSizes) {
+            std::vector<std::string> inputs = MakeInputs(size, nearly_sorted);
+            std::size_t calls = kBytes / size;
+            // The first adaptive pass includes learning and reacting to drift
+            double adaptive_ns = TimeCalls(inputs, calls, [&](std::string_view data) {
+                return context.doAlgorithm(data);
+            });
+            std::vector<double> probe_ns;
+            for(const auto& [name, strategy] : fixed) {
+                probe_ns.push_back(TimeCalls(inputs, 64, [&](std::string_view data) {
+                    return strategy->doAlgorithm(data);
+                }));
+            }
+            double fastest_ns = *std::min_element(probe_ns.begin(), probe_ns.end());
+            // Interleave short runs of every strategy and of the settled context, then take medians
+            std::size_t chunk = calls / kRounds;
+            std::vector<std::vector<double>> fixed_ns(fixed.size());
+            std::vector<double> steady_ns;
+            for(std::size_t round = 0; round < kRounds; round++) {
+                for(std::size_t i = 0; i < fixed.size(); i++) {
+                    // Slow candidates get fewer calls, so each one runs about as long as the fastest
+                    std::size_t timed = std::max<std::size_t>(4, chunk * fastest_ns / probe_ns[i]);
+                    fixed_ns[i].push_back(TimeCalls(inputs, timed, [&](std::string_view data) {
+                        return fixed[i].second->doAlgorithm(data);
+                    }));
+                }
+                steady_ns.push_back(TimeCalls(inputs, chunk, [&](std::string_view data) {
+                    return context.doAlgorithm(data);
+                }));
+            }
+            std::size_t oracle = 0, chosen = 0;
+            std::vector<double> medians;
+            for(std::size_t i = 0; i < fixed.size(); i++) {
+                medians.push_back(Median(fixed_ns[i]));
+                oracle = medians[i] < medians[oracle] ? i : oracle;
+                chosen = fixed[i].first == context.choice(size) ? i : chosen;
+            }
+            double steady = Median(steady_ns);
+            oracle_total += medians[oracle] * calls;
+            adaptive_total += adaptive_ns * calls;
+            matches += chosen == oracle;
+            runs++;
+            std::cout << "  size " << size << ": oracle " << fixed[oracle].first << " " << medians[oracle]
+                      << " ns, adaptive " << fixed[chosen].first << " " << adaptive_ns << " ns first pass, "
+                      << steady << " ns settled, " << 100 * (steady - medians[oracle]) / medians[oracle]
+                      << "% over the oracle";
+            if(chosen != oracle) {
+                std::cout << " (a different choice, " << 100 * (steady - medians[chosen]) / medians[chosen]
+                          << "% over calling it directly)";
+            }
+            std::cout << "\n";
+        }
+        std::cout << "  " << context.rewarms() - rewarms << " re-measurements after drift\n";
+    }
+    std::cout << " First passes take " << adaptive_total / oracle_total << "x the oracle, " << matches << " of "
+              << runs << " sizes settled on the oracle's choice, " << context.samples() << " timed calls, "
+              << context.explorations() << " explorations\n";
+}
 int main() {
     ClientCode();
+    AdaptiveClientCode();
+    BenchmarkAdaptive();
     return 0;
 }